@@ -0,0 +1,140 @@
+#include "batchqueue.h"
+
+#include <QDebug>
+#include <QRunnable>
+#include <QThread>
+
+#include "resynthesizer.h"
+#include "utils.h"
+
+struct DecodeTask: public QRunnable
+{
+    DecodeTask(BatchQueue* queue, const InpaintJob& job): queue_(queue), job_(job) {}
+    void run() { queue_->decode(job_); }
+
+    BatchQueue* queue_;
+    InpaintJob job_;
+};
+
+struct ComputeTask: public QRunnable
+{
+    ComputeTask(BatchQueue* queue, const InpaintJob& job): queue_(queue), job_(job) {}
+    void run() { queue_->compute(job_); }
+
+    BatchQueue* queue_;
+    InpaintJob job_;
+};
+
+struct EncodeTask: public QRunnable
+{
+    EncodeTask(BatchQueue* queue, const InpaintJob& job, const QImage& result):
+        queue_(queue), job_(job), result_(result) {}
+    void run() { queue_->encode(job_, result_); }
+
+    BatchQueue* queue_;
+    InpaintJob job_;
+    QImage result_;
+};
+
+BatchQueue::BatchQueue(int concurrentJobs, QObject* parent): QObject(parent),
+    library_(NULL), fieldCache_(NULL), preset_(RPresetBalanced), timeBudget_(0),
+    initMode_(RInitRandom), splitHoles_(false),
+    failedCount_(0)
+{
+    int cores = QThread::idealThreadCount();
+    if (concurrentJobs <= 0)
+        concurrentJobs = qMax(1, cores/2);
+
+    // every job thread takes chunks of its own passes too,
+    // so the pass pool only gets the cores left over
+    chunksPerJob_ = qMax(1, cores/concurrentJobs);
+
+    decodePool_.setMaxThreadCount(1);
+    computePool_.setMaxThreadCount(concurrentJobs);
+    passPool_.setMaxThreadCount(qMax(1, cores - concurrentJobs));
+    encodePool_.setMaxThreadCount(1);
+
+    // decode ahead one image per running job
+    inFlight_.release(2*concurrentJobs);
+
+    qDebug() << "batch queue:" << concurrentJobs << "concurrent jobs,"
+        << chunksPerJob_ << "chunks per pass";
+}
+
+BatchQueue::~BatchQueue()
+{
+    waitForDone();
+}
+
+void BatchQueue::enqueue(const InpaintJob& job)
+{
+    decodePool_.start(new DecodeTask(this, job));
+}
+
+void BatchQueue::waitForDone()
+{
+    // jobs only move forward, so draining the stages in order is enough
+    decodePool_.waitForDone();
+    computePool_.waitForDone();
+    encodePool_.waitForDone();
+}
+
+void BatchQueue::decode(InpaintJob job)
+{
+    inFlight_.acquire();
+
+    job.image = QImage(job.imagePath).convertToFormat(QImage::Format_ARGB32);
+    QImage mask(job.maskPath);
+
+    if (job.image.isNull() || mask.isNull() || mask.size() != job.image.size()) {
+        qDebug() << "can't load" << job.imagePath << job.maskPath;
+        fail(job);
+        return;
+    }
+
+    job.overlay = mask_to_overlay(mask);
+
+    computePool_.start(new ComputeTask(this, job));
+}
+
+void BatchQueue::compute(InpaintJob job)
+{
+    TRACE_ME
+
+    Resynthesizer r;
+    r.setThreadPool(&passPool_, chunksPerJob_);
+    r.setSourceLibrary(library_);
+    r.setFieldCache(fieldCache_);
+    r.setPreset(preset_);
+    r.setTimeBudget(timeBudget_);
+    r.setInitMode(initMode_);
+    r.setSplitHoles(splitHoles_);
+
+    QImage result = r.inpaintHier(job.image, job.overlay);
+
+    // decoded input isn't needed anymore
+    job.image = QImage();
+    job.overlay = QImage();
+
+    encodePool_.start(new EncodeTask(this, job, result));
+}
+
+void BatchQueue::encode(InpaintJob job, QImage result)
+{
+    bool ok = result.save(job.outputPath);
+    if (!ok)
+        qDebug() << "can't save" << job.outputPath;
+
+    inFlight_.release();
+
+    if (!ok)
+        failedCount_.ref();
+    emit jobFinished(job.outputPath, ok);
+}
+
+void BatchQueue::fail(const InpaintJob& job)
+{
+    inFlight_.release();
+    failedCount_.ref();
+    emit jobFinished(job.outputPath, false);
+}
@@ -0,0 +1,94 @@
+#ifndef UNSEEIT_BATCHQUEUE_H
+#define UNSEEIT_BATCHQUEUE_H
+
+#include <QAtomicInt>
+#include <QImage>
+#include <QObject>
+#include <QSemaphore>
+#include <QString>
+#include <QThreadPool>
+
+#include "resynthesizer.h"
+
+class NnfCache;
+class SourceLibrary;
+
+struct InpaintJob
+{
+    QString imagePath;
+    // light pixels are holes
+    QString maskPath;
+    QString outputPath;
+
+    // filled by the decode stage
+    QImage image;
+    QImage overlay;
+};
+
+// Runs many inpainting jobs at once.
+//
+// Every job goes through three stages: decode, compute and encode. Decoding
+// and encoding have a thread each, so I/O of one job overlaps with compute
+// of others. Cores are split between concurrently computed jobs and the
+// PatchMatch passes inside each of them.
+class BatchQueue: public QObject
+{
+    Q_OBJECT
+
+public:
+    // concurrentJobs == 0 picks a value from the number of cores
+    BatchQueue(int concurrentJobs = 0, QObject* parent = 0);
+    ~BatchQueue();
+
+    // every job is filled from the library, which must outlive the queue
+    void setSourceLibrary(const SourceLibrary* library) { library_ = library; }
+
+    // warm starts from fields of earlier runs on the same inputs
+    void setFieldCache(const NnfCache* cache) { fieldCache_ = cache; }
+
+    // see Resynthesizer::setPreset and Resynthesizer::setTimeBudget,
+    // the budget is per job and counts compute only
+    void setPreset(ResynthesizerPreset preset) { preset_ = preset; }
+    void setTimeBudget(int msec) { timeBudget_ = msec; }
+    void setInitMode(ResynthesizerInit mode) { initMode_ = mode; }
+    void setSplitHoles(bool split) { splitHoles_ = split; }
+
+    void enqueue(const InpaintJob& job);
+
+    // blocks until every enqueued job is written out
+    void waitForDone();
+
+    int failedCount() const { return failedCount_; }
+
+signals:
+    void jobFinished(QString outputPath, bool ok);
+
+private:
+    friend struct DecodeTask;
+    friend struct ComputeTask;
+    friend struct EncodeTask;
+
+    void decode(InpaintJob job);
+    void compute(InpaintJob job);
+    void encode(InpaintJob job, QImage result);
+    void fail(const InpaintJob& job);
+
+    QThreadPool decodePool_;
+    QThreadPool computePool_;
+    QThreadPool passPool_;
+    QThreadPool encodePool_;
+
+    // bounds the number of decoded images kept in memory
+    QSemaphore inFlight_;
+
+    int chunksPerJob_;
+    const SourceLibrary* library_;
+    const NnfCache* fieldCache_;
+    ResynthesizerPreset preset_;
+    int timeBudget_;
+    ResynthesizerInit initMode_;
+    bool splitHoles_;
+    QAtomicInt failedCount_;
+};
+
+#endif
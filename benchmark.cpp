@@ -0,0 +1,190 @@
+#include "benchmark.h"
+
+#include <QImage>
+#include <QTextStream>
+#include <QTime>
+#include <QtGlobal>
+#include <qmath.h>
+#include <cstdio>
+
+#include "bitmask.h"
+#include "resynthesizer.h"
+#include "similaritymapper.h"
+#include "utils.h"
+
+namespace {
+
+const int HOLE_COUNT = 4;
+const int HOLE_SEED = 1;
+// hole radius as a fraction of the smaller image side
+const int HOLE_RADIUS_DIVISOR = 16;
+
+const char* PRESET_NAMES[] = { "fast", "balanced", "best" };
+const char* LAYOUT_NAMES[] = { "row-major", "tiled" };
+
+const int R = 4;
+const int LAYOUT_PASS_COUNT = 4;
+const int LAYOUT_SEED = 1;
+
+// overlay with round holes away from the edges, hole pixels are 0xff000000
+QImage synthetic_holes(QSize size)
+{
+    QImage result(size, QImage::Format_ARGB32);
+    result.fill(0);
+
+    int radius = qMax(2, qMin(size.width(), size.height())/HOLE_RADIUS_DIVISOR);
+    int margin = 2*radius;
+    if (size.width() <= 2*margin || size.height() <= 2*margin)
+        return result;
+
+    qsrand(HOLE_SEED);
+    for (int n=0; n<HOLE_COUNT; ++n) {
+        QPoint c(margin + qrand()%(size.width() - 2*margin),
+                 margin + qrand()%(size.height() - 2*margin));
+        for (int j=-radius; j<=radius; ++j)
+            for (int i=-radius; i<=radius; ++i)
+                if (i*i + j*j <= radius*radius)
+                    result.setPixel(c + QPoint(i, j), 0xff000000);
+    }
+
+    return result;
+}
+
+// over the hole pixels, infinite for a perfect fill
+double psnr(const QImage& original, const QImage& result, const QImage& holes, int* holePixels)
+{
+    double squared_error = 0;
+    int count = 0;
+
+    for (int j=0; j<holes.height(); ++j)
+        for (int i=0; i<holes.width(); ++i) {
+            if (!holes.pixel(i, j))
+                continue;
+
+            QRgb a = original.pixel(i, j);
+            QRgb b = result.pixel(i, j);
+            int dr = qRed(a) - qRed(b);
+            int dg = qGreen(a) - qGreen(b);
+            int db = qBlue(a) - qBlue(b);
+            squared_error += dr*dr + dg*dg + db*db;
+            ++count;
+        }
+
+    *holePixels = count;
+    if (!count || squared_error == 0)
+        return HUGE_VAL;
+
+    double mse = squared_error/(3.0*count);
+    return 10*log10(255.0*255.0/mse);
+}
+
+};
+
+int run_benchmark(const QString& imagePath, const QList<int>& budgets)
+{
+    QImage original = QImage(imagePath).convertToFormat(QImage::Format_ARGB32);
+    if (original.isNull()) {
+        qDebug() << "can't load" << imagePath;
+        return 1;
+    }
+
+    QImage holes = synthetic_holes(original.size());
+
+    // the engine has to see the holes, not the original pixels
+    QImage input = original;
+    for (int j=0; j<holes.height(); ++j)
+        for (int i=0; i<holes.width(); ++i)
+            if (holes.pixel(i, j))
+                input.setPixel(i, j, 0xff000000);
+
+    QList<int> runs;
+    runs << 0 << budgets;
+
+    QTextStream out(stdout);
+    out << "preset,budget_ms,width,height,hole_pixels,msec,psnr\n";
+    out.flush();
+
+    for (int preset=RPresetFast; preset<=RPresetBest; ++preset)
+        foreach (int budget, runs) {
+            Resynthesizer r;
+            r.setPreset(ResynthesizerPreset(preset));
+            r.setTimeBudget(budget);
+
+            QTime clock;
+            clock.start();
+            QImage result = r.inpaintHier(input, holes);
+            int msec = clock.elapsed();
+
+            int hole_pixels = 0;
+            double quality = psnr(original, result, holes, &hole_pixels);
+
+            out << PRESET_NAMES[preset] << "," << budget << ","
+                << original.width() << "," << original.height() << ","
+                << hole_pixels << "," << msec << ","
+                << ((quality == HUGE_VAL)?QString("inf"):QString::number(quality, 'f', 2)) << "\n";
+            out.flush();
+        }
+
+    return 0;
+}
+
+int run_layout_benchmark(const QString& imagePath, int megapixels)
+{
+    QImage original = QImage(imagePath).convertToFormat(QImage::Format_ARGB32);
+    if (original.isNull()) {
+        qDebug() << "can't load" << imagePath;
+        return 1;
+    }
+
+    qint64 area = qint64(original.width())*original.height();
+    qint64 wanted = qint64(megapixels)*1000000;
+    if (area < wanted) {
+        qreal scale = qSqrt(qreal(wanted)/area);
+        original = original.scaled(qCeil(original.width()*scale), qCeil(original.height()*scale),
+                Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    }
+
+    BitMask holes = BitMask::fromImage(synthetic_holes(original.size()));
+    QImage input = original;
+    for (int j=0; j<holes.height(); ++j)
+        for (int i=holes.nextSet(j, 0); i<holes.width(); i=holes.nextSet(j, i+1))
+            input.setPixel(i, j, 0xff000000);
+
+    // known pixels whose whole patch is known, as Resynthesizer does
+    BitMask known = holes.inverted();
+    for (int pass=0; pass<=R; ++pass)
+        known = known.shrunk();
+
+    int hole_pixels = 0;
+    for (int j=0; j<holes.height(); ++j)
+        for (int i=holes.nextSet(j, 0); i<holes.width(); i=holes.nextSet(j, i+1))
+            ++hole_pixels;
+
+    QTextStream out(stdout);
+    out << "layout,width,height,hole_pixels,init_msec,passes_msec,mean_score\n";
+    out.flush();
+
+    for (int layout=SMLayoutRowMajor; layout<=SMLayoutTiled; ++layout) {
+        SimilarityMapper sm;
+        sm.setSourceLayout(SimilarityMapperLayout(layout));
+        sm.setPassCount(LAYOUT_PASS_COUNT);
+
+        qsrand(LAYOUT_SEED);
+        QTime clock;
+        clock.start();
+        sm.init(input, input, known, known);
+        int init_msec = clock.elapsed();
+
+        clock.start();
+        sm.iterate(input);
+        int passes_msec = clock.elapsed();
+
+        out << LAYOUT_NAMES[layout] << ","
+            << input.width() << "," << input.height() << ","
+            << hole_pixels << "," << init_msec << "," << passes_msec << ","
+            << QString::number(sm.meanScore(), 'f', 1) << "\n";
+        out.flush();
+    }
+
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef UNSEEIT_BENCHMARK_H
+#define UNSEEIT_BENCHMARK_H
+
+#include <QList>
+#include <QString>
+
+// Quality against wall time of every Resynthesizer preset.
+//
+// Holes are cut into the image at the same pseudo-random places every run
+// and filled, the fill is compared with the original pixels. Every preset
+// runs without a time budget and then with each of the given budgets.
+// One CSV line per run goes to stdout:
+//
+//   preset,budget_ms,width,height,hole_pixels,msec,psnr
+//
+// psnr is in dB over the hole pixels. Returns the exit code.
+int run_benchmark(const QString& imagePath, const QList<int>& budgets);
+
+// PatchMatch speed with row-major and tiled source layouts.
+//
+// The image is scaled up to at least the given number of megapixels,
+// holes are cut as above and full resolution SimilarityMapper passes
+// run from the same random initial field with every layout. One CSV
+// line each:
+//
+//   layout,width,height,hole_pixels,init_msec,passes_msec,mean_score
+int run_layout_benchmark(const QString& imagePath, int megapixels);
+
+#endif
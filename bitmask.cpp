@@ -0,0 +1,295 @@
+#include "bitmask.h"
+
+#include <algorithm>
+
+namespace {
+    inline int words_per_row(int width)
+    {
+        return (width + 31) >> 5;
+    }
+
+    // bits of the last word of a row that are real pixels
+    inline quint32 last_word_mask(int width)
+    {
+        return (width & 31)?((1u << (width & 31)) - 1):~0u;
+    }
+
+    // first set bit of a row at column i or later, the words are
+    // complemented first when looking for clear bits
+    inline int next_bit(const quint32* row, int words, int width, int i, quint32 flip)
+    {
+        if (i >= width)
+            return width;
+        int word = i >> 5;
+        quint32 bits = (row[word] ^ flip) & (~0u << (i & 31));
+        while (!bits) {
+            if (++word >= words)
+                return width;
+            bits = row[word] ^ flip;
+        }
+        return std::min(width, (word << 5) + __builtin_ctz(bits));
+    }
+};
+
+BitMask::BitMask(int width, int height, bool value):
+    w_(width), h_(height), wordsPerRow_(words_per_row(width)),
+    bits_(wordsPerRow_*height)
+{
+    fill(value);
+}
+
+BitMask::BitMask(const QSize& size, bool value):
+    w_(size.width()), h_(size.height()), wordsPerRow_(words_per_row(size.width())),
+    bits_(wordsPerRow_*size.height())
+{
+    fill(value);
+}
+
+BitMask BitMask::fromImage(const QImage& image)
+{
+    BitMask result(image.size());
+
+    for (int j = 0; j < result.h_; ++j) {
+        const uchar* line = image.scanLine(j);
+        quint32* row = result.row(j);
+
+        switch (image.format()) {
+        case QImage::Format_Mono:
+            for (int i = 0; i < result.w_; ++i)
+                if ((line[i >> 3] >> (7 - (i & 7))) & 1)
+                    row[i >> 5] |= 1u << (i & 31);
+            break;
+        case QImage::Format_MonoLSB:
+            for (int i = 0; i < result.w_; ++i)
+                if ((line[i >> 3] >> (i & 7)) & 1)
+                    row[i >> 5] |= 1u << (i & 31);
+            break;
+        case QImage::Format_RGB32:
+        case QImage::Format_ARGB32:
+        case QImage::Format_ARGB32_Premultiplied:
+            for (int i = 0; i < result.w_; ++i)
+                if (reinterpret_cast<const QRgb*>(line)[i])
+                    row[i >> 5] |= 1u << (i & 31);
+            break;
+        default:
+            for (int i = 0; i < result.w_; ++i)
+                if (image.pixel(i, j))
+                    row[i >> 5] |= 1u << (i & 31);
+            break;
+        }
+    }
+
+    return result;
+}
+
+BitMask BitMask::fromBytes(const uchar* data, int width, int height, int stride)
+{
+    BitMask result(width, height);
+
+    for (int j = 0; j < height; ++j) {
+        const uchar* line = data + j*stride;
+        quint32* row = result.row(j);
+        for (int i = 0; i < width; ++i)
+            if (line[i])
+                row[i >> 5] |= 1u << (i & 31);
+    }
+
+    return result;
+}
+
+QImage BitMask::toImage() const
+{
+    QImage result(w_, h_, QImage::Format_Mono);
+    result.fill(0);
+
+    for (int j = 0; j < h_; ++j) {
+        uchar* line = result.scanLine(j);
+        for (int i = nextSet(j, 0); i < w_; i = nextSet(j, i+1))
+            line[i >> 3] |= 0x80 >> (i & 7);
+    }
+
+    return result;
+}
+
+void BitMask::fill(bool value)
+{
+    bits_.fill(value?~0u:0u);
+
+    quint32 last = last_word_mask(w_);
+    if (value && ~last)
+        for (int j = 0; j < h_; ++j)
+            row(j)[wordsPerRow_-1] = last;
+}
+
+bool BitMask::isEmpty() const
+{
+    // padding bits are clear
+    for (int k = 0; k < bits_.size(); ++k)
+        if (bits_[k])
+            return false;
+    return true;
+}
+
+int BitMask::nextSet(int j, int i) const
+{
+    return next_bit(row(j), wordsPerRow_, w_, i, 0);
+}
+
+int BitMask::nextClear(int j, int i) const
+{
+    return next_bit(row(j), wordsPerRow_, w_, i, ~0u);
+}
+
+bool BitMask::patchSet(const QPoint& p, int r) const
+{
+    for (int j = p.y()-r; j <= p.y()+r; ++j)
+        if (nextClear(j, p.x()-r) <= p.x()+r)
+            return false;
+    return true;
+}
+
+BitMask BitMask::inverted() const
+{
+    BitMask result(*this);
+    quint32 last = last_word_mask(w_);
+
+    for (int j = 0; j < h_; ++j) {
+        quint32* row = result.row(j);
+        for (int k = 0; k < wordsPerRow_; ++k)
+            row[k] = ~row[k];
+        row[wordsPerRow_-1] &= last;
+    }
+
+    return result;
+}
+
+BitMask& BitMask::operator&=(const BitMask& other)
+{
+    Q_ASSERT(size() == other.size());
+
+    quint32* words = bits_.data();
+    const quint32* other_words = other.bits_.constData();
+    for (int k = 0; k < bits_.size(); ++k)
+        words[k] &= other_words[k];
+
+    return *this;
+}
+
+BitMask BitMask::shrunk() const
+{
+    BitMask result(w_, h_);
+    quint32 last = last_word_mask(w_);
+
+    for (int j = 0; j < h_; ++j) {
+        const quint32* row = this->row(j);
+        const quint32* above = this->row(j > 0?j-1:j);
+        const quint32* below = this->row(j+1 < h_?j+1:j);
+        quint32* out = result.row(j);
+
+        for (int k = 0; k < wordsPerRow_; ++k) {
+            // neighbours left and right, carrying bits across words;
+            // outside the row counts as set
+            quint32 lower = (k > 0)?(row[k-1] >> 31):1u;
+            quint32 upper = (k+1 < wordsPerRow_)?(row[k+1] << 31):0u;
+            quint32 left = (row[k] << 1) | lower;
+            quint32 right = (row[k] >> 1) | upper;
+            if (k+1 == wordsPerRow_)
+                right |= ~(last >> 1);
+            out[k] = row[k] & left & right & above[k] & below[k];
+        }
+    }
+
+    return result;
+}
+
+BitMask BitMask::dilated(int r) const
+{
+    // runs widened along rows first
+    BitMask wide(w_, h_);
+    for (int j = 0; j < h_; ++j)
+        for (int i = nextSet(j, 0); i < w_; ) {
+            int end = nextClear(j, i);
+            for (int k = std::max(0, i-r); k < std::min(w_, end+r); ++k)
+                wide.set(k, j);
+            i = nextSet(j, end);
+        }
+
+    // then every row is the union of the 2r+1 rows around it
+    BitMask result(w_, h_);
+    for (int j = 0; j < h_; ++j) {
+        quint32* out = result.row(j);
+        for (int y = std::max(0, j-r); y <= std::min(h_-1, j+r); ++y) {
+            const quint32* in = wide.row(y);
+            for (int k = 0; k < wordsPerRow_; ++k)
+                out[k] |= in[k];
+        }
+    }
+
+    return result;
+}
+
+BitMask BitMask::withoutBorder(int r) const
+{
+    BitMask result(w_, h_);
+
+    for (int j = r; j < h_-r; ++j)
+        for (int i = nextSet(j, r); i < w_-r; ) {
+            int end = std::min(nextClear(j, i), w_-r);
+            for (int k = i; k < end; ++k)
+                result.set(k, j);
+            i = nextSet(j, end);
+        }
+
+    return result;
+}
+
+BitMask BitMask::rows(int begin, int end) const
+{
+    BitMask result(w_, end-begin);
+    std::copy(row(begin), row(begin) + (end-begin)*wordsPerRow_, result.row(0));
+    return result;
+}
+
+BitMask BitMask::cropped(const QRect& rect) const
+{
+    BitMask result(rect.size());
+
+    for (int j = 0; j < rect.height(); ++j) {
+        int y = rect.top() + j;
+        for (int i = nextSet(y, rect.left()); i <= rect.right(); ) {
+            int end = std::min(nextClear(y, i), rect.right()+1);
+            for (int k = i; k < end; ++k)
+                result.set(k - rect.left(), j);
+            i = nextSet(y, end);
+        }
+    }
+
+    return result;
+}
+
+BitMask BitMask::scaled(const QSize& size) const
+{
+    if (size == this->size())
+        return *this;
+
+    BitMask result(size);
+    int dw = size.width();
+    int dh = size.height();
+
+    for (int j = 0; j < dh; ++j) {
+        // rows and columns of this mask the pixel covers
+        int y0 = j*h_/dh;
+        int y1 = std::max(y0+1, ((j+1)*h_ + dh-1)/dh);
+        for (int i = 0; i < dw; ++i) {
+            int x0 = i*w_/dw;
+            int x1 = std::max(x0+1, ((i+1)*w_ + dw-1)/dw);
+            for (int y = y0; y < y1; ++y)
+                if (nextSet(y, x0) < x1) {
+                    result.set(i, j);
+                    break;
+                }
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,111 @@
+#ifndef UNSEEIT_BITMASK_H
+#define UNSEEIT_BITMASK_H
+
+#include <QImage>
+#include <QSize>
+#include <QPoint>
+#include <QRect>
+#include <QVector>
+#include <QtGlobal>
+
+// Binary mask with one bit per pixel and rows padded to 32 bit words.
+//
+// Replaces QImage::Format_Mono masks in the engine: tests are an inline
+// shift and mask instead of a pixelIndex call, and runs of set or clear
+// pixels in a row are found a word at a time.
+class BitMask
+{
+public:
+    BitMask(): w_(0), h_(0), wordsPerRow_(0) {}
+    BitMask(int width, int height, bool value = false);
+    BitMask(const QSize& size, bool value = false);
+
+    // set where the pixel index of a mono image is 1,
+    // or where the pixel of any other image is non-zero
+    static BitMask fromImage(const QImage& image);
+    // one byte per pixel, set where the byte is non-zero
+    static BitMask fromBytes(const uchar* data, int width, int height, int stride);
+    // mono, pixel index 1 where set
+    QImage toImage() const;
+
+    int width() const { return w_; }
+    int height() const { return h_; }
+    QSize size() const { return QSize(w_, h_); }
+    bool isNull() const { return !(w_ && h_); }
+    // no pixel is set
+    bool isEmpty() const;
+
+    bool contains(const QPoint& p) const {
+        return (uint)p.x() < (uint)w_ && (uint)p.y() < (uint)h_;
+    }
+
+    bool test(int i, int j) const {
+        Q_ASSERT(i>=0 && i<w_ && j>=0 && j<h_);
+        return (bits_[j*wordsPerRow_ + (i >> 5)] >> (i & 31)) & 1;
+    }
+
+    bool test(const QPoint& p) const {
+        return test(p.x(), p.y());
+    }
+
+    void set(int i, int j, bool value = true) {
+        Q_ASSERT(i>=0 && i<w_ && j>=0 && j<h_);
+        quint32& word = bits_[j*wordsPerRow_ + (i >> 5)];
+        if (value)
+            word |= 1u << (i & 31);
+        else
+            word &= ~(1u << (i & 31));
+    }
+
+    void set(const QPoint& p, bool value = true) {
+        set(p.x(), p.y(), value);
+    }
+
+    void fill(bool value);
+
+    // first set (clear) pixel of row j at column i or later, width() if
+    // there is none; runs of set pixels are [nextSet, nextClear)
+    int nextSet(int j, int i) const;
+    int nextClear(int j, int i) const;
+
+    // every pixel of the (2r+1)x(2r+1) patch around p is set,
+    // p has to be at least r pixels away from the edges
+    bool patchSet(const QPoint& p, int r) const;
+
+    BitMask inverted() const;
+
+    // keeps the pixels set in both, sizes have to match
+    BitMask& operator&=(const BitMask& other);
+
+    // clears pixels with a clear 4-neighbour, outside counts as set
+    BitMask shrunk() const;
+
+    // sets every pixel within r of a set one, in both directions
+    BitMask dilated(int r) const;
+
+    // also clears everything within r of the edges
+    BitMask withoutBorder(int r) const;
+
+    // rows begin .. end-1
+    BitMask rows(int begin, int end) const;
+
+    // the part under rect, which has to be inside the mask
+    BitMask cropped(const QRect& rect) const;
+
+    // a pixel of the result is set when any pixel it covers is,
+    // for pyramid levels of hole masks
+    BitMask scaled(const QSize& size) const;
+
+    int wordsPerRow() const { return wordsPerRow_; }
+    const quint32* row(int j) const { return bits_.constData() + j*wordsPerRow_; }
+    quint32* row(int j) { return bits_.data() + j*wordsPerRow_; }
+
+private:
+    int w_;
+    int h_;
+    int wordsPerRow_;
+    // bit i%32 of word i/32 is column i, padding bits are clear
+    QVector<quint32> bits_;
+};
+
+#endif
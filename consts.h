@@ -3,5 +3,8 @@
 
 const int JOB_CHUNK_COUNT = 2;
 
+// pyramid levels prepared for source libraries
+const int LIBRARY_LEVEL_COUNT = 4;
+
 #endif /* end of include guard: CONSTS_H_K3M4QHJW */
 
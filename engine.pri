@@ -0,0 +1,9 @@
+# engine sources, shared by engine.pro and anything building it in
+
+DEPENDPATH += $$PWD
+INCLUDEPATH += $$PWD
+
+HEADERS += $$PWD/unseeit.h $$PWD/resynthesizer.h $$PWD/utils.h $$PWD/randomoffsetgenerator.h $$PWD/similaritymapper.h $$PWD/cowmatrix.h $$PWD/parallel.h $$PWD/batchqueue.h $$PWD/patchindex.h $$PWD/knnfield.h $$PWD/sourcelibrary.h $$PWD/nnfcache.h $$PWD/sequenceinpainter.h $$PWD/shardedmapper.h $$PWD/fillspans.h $$PWD/bitmask.h $$PWD/consts.h $$PWD/pixel.h $$PWD/sourcetiles.h $$PWD/imageview.h
+SOURCES += $$PWD/unseeit.cpp $$PWD/resynthesizer.cpp $$PWD/randomoffsetgenerator.cpp $$PWD/similaritymapper.cpp $$PWD/utils.cpp $$PWD/batchqueue.cpp $$PWD/patchindex.cpp $$PWD/sourcelibrary.cpp $$PWD/nnfcache.cpp $$PWD/sequenceinpainter.cpp $$PWD/shardedmapper.cpp $$PWD/fillspans.cpp $$PWD/bitmask.cpp $$PWD/sourcetiles.cpp $$PWD/imageview.cpp
+
+QMAKE_CXXFLAGS += -O2 -g -std=c++0x -Wshadow
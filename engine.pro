@@ -0,0 +1,7 @@
+# inpainting engine as a static library, see unseeit.h for the API
+
+TEMPLATE = lib
+CONFIG += staticlib
+TARGET = unseeitengine
+
+include(engine.pri)
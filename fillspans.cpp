@@ -0,0 +1,87 @@
+#include "fillspans.h"
+
+#include <algorithm>
+
+FillSpans::Iterator::Iterator(const FillSpans* set, int dx, int rowStep,
+        int row, int span, int x, int count):
+    set_(set), dx_(dx), rowStep_(rowStep),
+    row_(row), span_(span), x_(x), remaining_(count)
+{
+}
+
+FillSpans::Iterator& FillSpans::Iterator::operator++()
+{
+    if (--remaining_ <= 0)
+        return *this;
+
+    x_ += dx_;
+    const Span& span = set_->spans_[span_];
+    if (x_ >= span.begin && x_ < span.end)
+        return *this;
+
+    // next span of the row, or the first one of the next row
+    span_ += dx_;
+    if (span_ < set_->rowStarts_[row_] || span_ >= set_->rowEnd(row_)) {
+        row_ += rowStep_;
+        span_ = (dx_ > 0)?set_->rowStarts_[row_]:set_->rowEnd(row_)-1;
+    }
+
+    const Span& next = set_->spans_[span_];
+    x_ = (dx_ > 0)?next.begin:next.end-1;
+    return *this;
+}
+
+void FillSpans::clear()
+{
+    spans_.clear();
+    rowStarts_.clear();
+    offsets_.clear();
+    size_ = 0;
+}
+
+void FillSpans::append(const QPoint& p)
+{
+    if (!spans_.isEmpty() && spans_.last().y == p.y() && spans_.last().end == p.x()) {
+        ++spans_.last().end;
+        ++size_;
+        return;
+    }
+
+    Q_ASSERT(spans_.isEmpty() || spans_.last().y < p.y() ||
+        (spans_.last().y == p.y() && spans_.last().end < p.x()));
+
+    if (spans_.isEmpty() || spans_.last().y != p.y())
+        rowStarts_ << spans_.size();
+
+    Span span = { p.y(), p.x(), p.x()+1 };
+    spans_ << span;
+    offsets_ << size_;
+    ++size_;
+}
+
+FillSpans::Iterator FillSpans::begin(Order order) const
+{
+    if (isEmpty())
+        return Iterator(this, 1, 1, 0, 0, 0, 0);
+
+    bool bottom_up = (BottomUpRightLeft == order || BottomUpLeftRight == order);
+    bool right_left = (TopDownRightLeft == order || BottomUpRightLeft == order);
+
+    int row = bottom_up?rowStarts_.size()-1:0;
+    int span = right_left?rowEnd(row)-1:rowStarts_[row];
+    int x = right_left?spans_[span].end-1:spans_[span].begin;
+
+    return Iterator(this, right_left?-1:1, bottom_up?-1:1, row, span, x, size_);
+}
+
+FillSpans::Iterator FillSpans::range(int begin, int end) const
+{
+    if (begin >= end)
+        return Iterator(this, 1, 1, 0, 0, 0, 0);
+
+    int span = std::upper_bound(offsets_.begin(), offsets_.end(), begin) - offsets_.begin() - 1;
+    int row = std::upper_bound(rowStarts_.begin(), rowStarts_.end(), span) - rowStarts_.begin() - 1;
+    int x = spans_[span].begin + begin - offsets_[span];
+
+    return Iterator(this, 1, 1, row, span, x, end-begin);
+}
@@ -0,0 +1,83 @@
+#ifndef UNSEEIT_FILLSPANS_H
+#define UNSEEIT_FILLSPANS_H
+
+#include <QPoint>
+#include <QVector>
+
+// Set of pixels stored as runs of consecutive pixels in rows.
+//
+// A hole takes 16 bytes per run instead of 8 per pixel for every order it
+// is walked in. Any of the four row/column directions can be walked
+// without copying or reversing anything.
+class FillSpans
+{
+public:
+    enum Order
+    {
+        // rows top down, pixels of a row left to right
+        TopDownLeftRight,
+        TopDownRightLeft,
+        BottomUpRightLeft,
+        BottomUpLeftRight
+    };
+
+    class Iterator
+    {
+    public:
+        bool atEnd() const { return remaining_ <= 0; }
+        QPoint operator*() const { return QPoint(x_, set_->spans_[span_].y); }
+        Iterator& operator++();
+
+    private:
+        friend class FillSpans;
+        Iterator(const FillSpans* set, int dx, int rowStep,
+            int row, int span, int x, int count);
+
+        const FillSpans* set_;
+        int dx_;
+        int rowStep_;
+        int row_;
+        int span_;
+        int x_;
+        int remaining_;
+    };
+
+    FillSpans(): size_(0) {}
+
+    void clear();
+
+    // points have to come in TopDownLeftRight order
+    void append(const QPoint& p);
+
+    int size() const { return size_; }
+    bool isEmpty() const { return !size_; }
+    int spanCount() const { return spans_.size(); }
+
+    Iterator begin(Order order) const;
+
+    // points begin .. end-1 of the TopDownLeftRight order,
+    // for splitting the set into chunks
+    Iterator range(int begin, int end) const;
+
+private:
+    struct Span
+    {
+        int y;
+        // columns begin .. end-1
+        int begin;
+        int end;
+    };
+
+    int rowEnd(int row) const {
+        return (row+1 < rowStarts_.size())?rowStarts_[row+1]:spans_.size();
+    }
+
+    QVector<Span> spans_;
+    // first span of every row
+    QVector<int> rowStarts_;
+    // number of points before every span
+    QVector<int> offsets_;
+    int size_;
+};
+
+#endif
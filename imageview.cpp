@@ -0,0 +1,34 @@
+#include "imageview.h"
+
+#include <QAtomicInt>
+#include <QDebug>
+#include <string.h>
+
+namespace {
+
+QAtomicInt detach_count;
+
+};
+
+QImage ImageView::toImage() const
+{
+    QImage result(width_, height_, QImage::Format_ARGB32);
+    for (int j=0; j<height_; ++j)
+        memcpy(result.scanLine(j), scanLine(j), 4*width_);
+    return result;
+}
+
+void DetachCheck::check(const QImage& image)
+{
+    if (image.constBits() != bits_) {
+        detach_count.ref();
+        qDebug() << "unexpected detach of a" << image.size() << "image";
+    }
+    Q_ASSERT(image.constBits() == bits_);
+    bits_ = image.constBits();
+}
+
+int DetachCheck::count()
+{
+    return detach_count;
+}
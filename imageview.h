@@ -0,0 +1,84 @@
+#ifndef UNSEEIT_IMAGEVIEW_H
+#define UNSEEIT_IMAGEVIEW_H
+
+#include <QImage>
+#include <QRect>
+
+// Read-only window on 32 bit pixels owned by someone else, a QImage or
+// a caller's buffer. Views never share, copy or detach pixels; whoever
+// made one keeps the pixels alive and unchanged while it's read.
+//
+// Taking a view instead of a QImage means the callee won't keep the
+// image, so the caller can go on writing to it without a deep copy.
+class ImageView
+{
+public:
+    ImageView(): bits_(NULL), width_(0), height_(0), stride_(0) {}
+
+    // image - argb32 or rgb32, implicit so QImages pass as views
+    ImageView(const QImage& image):
+        bits_(image.constBits()), width_(image.width()), height_(image.height()),
+        stride_(image.bytesPerLine())
+    {
+        Q_ASSERT(image.isNull() || image.depth() == 32);
+    }
+
+    // stride in bytes
+    ImageView(const uchar* bits, int width, int height, int stride):
+        bits_(bits), width_(width), height_(height), stride_(stride) {}
+
+    bool isNull() const { return !bits_; }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    QSize size() const { return QSize(width_, height_); }
+    QRect rect() const { return QRect(0, 0, width_, height_); }
+
+    // bytes from one row to the next
+    int stride() const { return stride_; }
+    const uchar* bits() const { return bits_; }
+
+    const QRgb* scanLine(int j) const {
+        return reinterpret_cast<const QRgb*>(bits_ + j*stride_);
+    }
+    QRgb pixel(int x, int y) const { return scanLine(y)[x]; }
+    QRgb pixel(const QPoint& p) const { return scanLine(p.y())[p.x()]; }
+
+    // the same pixels, rect has to be inside the view
+    ImageView cropped(const QRect& rect) const {
+        Q_ASSERT(this->rect().contains(rect));
+        return ImageView(bits_ + rect.top()*stride_ + 4*rect.left(),
+                rect.width(), rect.height(), stride_);
+    }
+
+    // deep copy, argb32
+    QImage toImage() const;
+
+private:
+    const uchar* bits_;
+    int width_;
+    int height_;
+    int stride_;
+};
+
+// Debug check for a buffer that is written in place. Remembers where the
+// pixels of image are; if they have moved by the time check() runs, a
+// write detached the image from a copy still held somewhere, which cost
+// a full deep copy and left the holder with stale pixels.
+class DetachCheck
+{
+public:
+    explicit DetachCheck(const QImage& image): bits_(image.constBits()) {}
+
+    // asserts image wasn't detached since the last check,
+    // counts it in release builds
+    void check(const QImage& image);
+
+    // detaches seen by every check so far
+    static int count();
+
+private:
+    const uchar* bits_;
+};
+
+#endif
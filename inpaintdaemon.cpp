@@ -0,0 +1,322 @@
+#include "inpaintdaemon.h"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QImage>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QSharedMemory>
+#include <QThread>
+#include <QTime>
+#include <string.h>
+
+#include <boost/bind/bind.hpp>
+
+#include "bitmask.h"
+#include "consts.h"
+#include "resynthesizer.h"
+#include "sourcelibrary.h"
+#include "utils.h"
+
+const int R = 4;
+
+// requests are a few paths and numbers, anything longer
+// is a client out of step with the protocol
+const quint32 MAX_REQUEST_SIZE = 64*1024;
+
+struct DaemonTask: public QRunnable
+{
+    DaemonTask(InpaintDaemon* daemon, const DaemonJob& job): daemon_(daemon), job_(job) {}
+    void run() { daemon_->run(job_); }
+
+    InpaintDaemon* daemon_;
+    DaemonJob job_;
+};
+
+namespace {
+
+enum Message
+{
+    MessageJob = 'J',
+    MessageProgress = 'P',
+    MessageDone = 'D',
+    MessageError = 'E'
+};
+
+void read_buffer(QDataStream& stream, DaemonBuffer* buffer)
+{
+    buffer->width = buffer->height = buffer->stride = 0;
+    stream >> buffer->kind >> buffer->path;
+    if (DaemonBuffer::KindShared == buffer->kind)
+        stream >> buffer->width >> buffer->height >> buffer->stride;
+}
+
+// bytesPerPixel wide rows of the buffer's size have to fit
+bool attach_shared(QSharedMemory* memory, const DaemonBuffer& buffer,
+    int bytesPerPixel, QSharedMemory::AccessMode mode)
+{
+    if (buffer.width <= 0 || buffer.height <= 0 ||
+        buffer.stride < (qint64)buffer.width*bytesPerPixel)
+        return false;
+
+    memory->setKey(buffer.path);
+    if (!memory->attach(mode))
+        return false;
+    qint64 row = (qint64)buffer.width*bytesPerPixel;
+    return memory->size() >= (qint64)buffer.stride*(buffer.height-1) + row;
+}
+
+};
+
+InpaintDaemon::InpaintDaemon(int concurrentJobs, QObject* parent): QObject(parent),
+    server_(new QLocalServer(this)), nextClient_(0), fieldCache_(NULL)
+{
+    int cores = QThread::idealThreadCount();
+    if (concurrentJobs <= 0)
+        concurrentJobs = qMax(1, cores/2);
+
+    // same split as BatchQueue: job threads take chunks of their
+    // own passes, the pass pool gets the cores left over
+    chunksPerJob_ = qMax(1, cores/concurrentJobs);
+    computePool_.setMaxThreadCount(concurrentJobs);
+    passPool_.setMaxThreadCount(qMax(1, cores - concurrentJobs));
+
+    // jobs come and go, keep the threads
+    computePool_.setExpiryTimeout(-1);
+    passPool_.setExpiryTimeout(-1);
+
+    connect(server_, SIGNAL(newConnection()), this, SLOT(acceptClients()));
+    connect(this, SIGNAL(replyReady(int, QByteArray)), this, SLOT(sendReply(int, QByteArray)));
+}
+
+InpaintDaemon::~InpaintDaemon()
+{
+    computePool_.waitForDone();
+    qDeleteAll(libraries_);
+}
+
+bool InpaintDaemon::listen(const QString& name)
+{
+    // a daemon that died leaves its socket behind
+    QLocalServer::removeServer(name);
+
+    if (!server_->listen(name)) {
+        qDebug() << "can't listen on" << name << server_->errorString();
+        return false;
+    }
+
+    qDebug() << "listening on" << server_->fullServerName();
+    return true;
+}
+
+void InpaintDaemon::acceptClients()
+{
+    while (server_->hasPendingConnections()) {
+        QLocalSocket* socket = server_->nextPendingConnection();
+        int client = nextClient_++;
+        clients_[client] = socket;
+        socket->setProperty("client", client);
+
+        connect(socket, SIGNAL(readyRead()), this, SLOT(readRequests()));
+        connect(socket, SIGNAL(disconnected()), this, SLOT(dropClient()));
+    }
+}
+
+void InpaintDaemon::readRequests()
+{
+    QLocalSocket* socket = qobject_cast<QLocalSocket*>(sender());
+    if (!socket)
+        return;
+
+    int client = socket->property("client").toInt();
+    QByteArray& pending = pending_[socket];
+    pending += socket->readAll();
+
+    // messages are a quint32 size followed by the payload
+    while (pending.size() >= int(sizeof(quint32))) {
+        quint32 size;
+        memcpy(&size, pending.constData(), sizeof(size));
+        if (size > MAX_REQUEST_SIZE) {
+            qDebug() << "client" << client << "sent a" << size << "byte message, dropping it";
+            // dropClient forgets the pending data
+            socket->abort();
+            return;
+        }
+        if (pending.size() < int(sizeof(size) + size))
+            break;
+
+        QByteArray message = pending.mid(sizeof(size), size);
+        pending.remove(0, sizeof(size) + size);
+
+        QDataStream stream(message);
+        quint8 kind;
+        stream >> kind;
+        if (MessageJob != kind) {
+            qDebug() << "client" << client << "sent unknown message" << kind;
+            continue;
+        }
+
+        DaemonJob job;
+        job.client = client;
+        stream >> job.id;
+        read_buffer(stream, &job.input);
+        read_buffer(stream, &job.mask);
+        read_buffer(stream, &job.output);
+        stream >> job.preset >> job.timeBudget >> job.libraryList;
+
+        if (stream.status() != QDataStream::Ok) {
+            fail(job, "malformed request");
+            continue;
+        }
+
+        computePool_.start(new DaemonTask(this, job));
+    }
+}
+
+void InpaintDaemon::dropClient()
+{
+    QLocalSocket* socket = qobject_cast<QLocalSocket*>(sender());
+    if (!socket)
+        return;
+
+    // jobs still running for it have their replies dropped
+    clients_.remove(socket->property("client").toInt());
+    pending_.remove(socket);
+    socket->deleteLater();
+}
+
+void InpaintDaemon::sendReply(int client, QByteArray message)
+{
+    QLocalSocket* socket = clients_.value(client);
+    if (!socket)
+        return;
+
+    quint32 size = message.size();
+    socket->write(reinterpret_cast<const char*>(&size), sizeof(size));
+    socket->write(message);
+}
+
+void InpaintDaemon::run(const DaemonJob& job)
+{
+    TRACE_ME
+
+    QTime clock;
+    clock.start();
+
+    Resynthesizer r;
+    r.setThreadPool(&passPool_, chunksPerJob_);
+    r.setPreset(ResynthesizerPreset(qBound(int(RPresetFast), int(job.preset), int(RPresetBest))));
+    r.setTimeBudget(job.timeBudget);
+    r.setFieldCache(fieldCache_);
+    r.setProgressCallback(boost::bind(&InpaintDaemon::progress, this, job.client, job.id, _1, _2));
+
+    if (!job.libraryList.isEmpty()) {
+        const SourceLibrary* source_library = library(job.libraryList);
+        if (!source_library) {
+            fail(job, "can't load library " + job.libraryList);
+            return;
+        }
+        r.setSourceLibrary(source_library);
+    }
+
+    // shared memory is used in place, it has to stay attached
+    // until the result is written
+    QSharedMemory input_memory;
+    QImage input;
+    if (DaemonBuffer::KindFile == job.input.kind) {
+        input = QImage(job.input.path).convertToFormat(QImage::Format_ARGB32);
+    } else if (DaemonBuffer::KindShared == job.input.kind) {
+        if (attach_shared(&input_memory, job.input, 4, QSharedMemory::ReadOnly))
+            input = QImage(static_cast<const uchar*>(input_memory.constData()),
+                job.input.width, job.input.height, job.input.stride, QImage::Format_ARGB32);
+    }
+    if (input.isNull()) {
+        fail(job, "can't read input " + job.input.path);
+        return;
+    }
+
+    QSharedMemory mask_memory;
+    BitMask holes;
+    if (DaemonBuffer::KindFile == job.mask.kind) {
+        QImage mask(job.mask.path);
+        if (!mask.isNull())
+            holes = BitMask::fromImage(mask_to_overlay(mask));
+    } else if (DaemonBuffer::KindShared == job.mask.kind) {
+        if (attach_shared(&mask_memory, job.mask, 1, QSharedMemory::ReadOnly))
+            holes = BitMask::fromBytes(static_cast<const uchar*>(mask_memory.constData()),
+                job.mask.width, job.mask.height, job.mask.stride);
+    }
+    if (holes.size() != input.size()) {
+        fail(job, "can't read mask " + job.mask.path + " or its size differs from the input");
+        return;
+    }
+
+    const QImage result = r.inpaintHier(input, holes);
+
+    QByteArray reply;
+    QDataStream stream(&reply, QIODevice::WriteOnly);
+
+    if (DaemonBuffer::KindFile == job.output.kind) {
+        if (!result.save(job.output.path)) {
+            fail(job, "can't save " + job.output.path);
+            return;
+        }
+        stream << (quint8)MessageDone << job.id << (qint32)clock.elapsed();
+    } else if (DaemonBuffer::KindShared == job.output.kind) {
+        QSharedMemory output_memory;
+        if (!attach_shared(&output_memory, job.output, 4, QSharedMemory::ReadWrite) ||
+            QSize(job.output.width, job.output.height) != result.size()) {
+            fail(job, "can't write output " + job.output.path);
+            return;
+        }
+        uchar* data = static_cast<uchar*>(output_memory.data());
+        for (int j=0; j<result.height(); ++j)
+            memcpy(data + j*job.output.stride, result.scanLine(j), 4*result.width());
+        stream << (quint8)MessageDone << job.id << (qint32)clock.elapsed();
+    } else {
+        stream << (quint8)MessageDone << job.id << (qint32)clock.elapsed()
+            << (qint32)result.width() << (qint32)result.height();
+        for (int j=0; j<result.height(); ++j)
+            stream.writeRawData(reinterpret_cast<const char*>(result.scanLine(j)), 4*result.width());
+    }
+
+    emit replyReady(job.client, reply);
+}
+
+void InpaintDaemon::progress(int client, qint32 id, int levelsDone, int levelCount)
+{
+    QByteArray reply;
+    QDataStream(&reply, QIODevice::WriteOnly) << (quint8)MessageProgress << id
+        << (qint32)levelsDone << (qint32)levelCount;
+    emit replyReady(client, reply);
+}
+
+void InpaintDaemon::fail(const DaemonJob& job, const QString& error)
+{
+    qDebug() << "job" << job.id << "of client" << job.client << "failed:" << error;
+
+    QByteArray reply;
+    QDataStream(&reply, QIODevice::WriteOnly) << (quint8)MessageError << job.id << error;
+    emit replyReady(job.client, reply);
+}
+
+const SourceLibrary* InpaintDaemon::library(const QString& listFilename)
+{
+    QMutexLocker locker(&librariesMutex_);
+
+    SourceLibrary* result = libraries_.value(listFilename);
+    if (result)
+        return result;
+
+    result = new SourceLibrary(R);
+    if (!result->addList(listFilename) || !result->sourceCount()) {
+        delete result;
+        return NULL;
+    }
+    result->prepare(LIBRARY_LEVEL_COUNT);
+
+    libraries_[listFilename] = result;
+    return result;
+}
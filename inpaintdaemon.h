@@ -0,0 +1,121 @@
+#ifndef UNSEEIT_INPAINTDAEMON_H
+#define UNSEEIT_INPAINTDAEMON_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QObject>
+#include <QString>
+#include <QThreadPool>
+
+class NnfCache;
+class QLocalServer;
+class QLocalSocket;
+class SourceLibrary;
+
+// where the pixels of a daemon job come from or go to
+struct DaemonBuffer
+{
+    enum Kind
+    {
+        // image file, path is its name
+        KindFile = 'F',
+        // QSharedMemory, path is its key
+        KindShared = 'S',
+        // output only, sent back in the done message
+        KindInline = 'I'
+    };
+
+    quint8 kind;
+    QString path;
+    // shared memory layout
+    qint32 width;
+    qint32 height;
+    qint32 stride;
+};
+
+struct DaemonJob
+{
+    int client;
+    qint32 id;
+    DaemonBuffer input;
+    DaemonBuffer mask;
+    DaemonBuffer output;
+    qint32 preset;
+    qint32 timeBudget;
+    QString libraryList;
+};
+
+// Long running inpainting service on a local socket.
+//
+// Saves process startup, thread pool warm-up and library preparation on
+// every job: the pools, lookup tables and source libraries (by list file
+// name) stay around between jobs. Clients connect to the name given to
+// listen() and send any number of requests, which run concurrently;
+// replies come back on the same connection.
+//
+// Every message is a native quint32 size followed by a QDataStream payload,
+// a client announcing a request over 64 KB is disconnected:
+//
+//   request  'J', qint32 id, input, mask, output,
+//            qint32 preset, qint32 timeBudget (msec, 0 for none),
+//            QString libraryList (empty for none)
+//   progress 'P', qint32 id, qint32 levelsDone, qint32 levelCount
+//   done     'D', qint32 id, qint32 msec; inline output adds
+//            qint32 width, qint32 height and the ARGB32 rows
+//   error    'E', qint32 id, QString message
+//
+// Buffers are a quint8 kind and a QString path or key; shared memory adds
+// qint32 width, height and stride. Input and output pixels are 32 bit
+// ARGB, mask pixels one byte with non-zero holes. Shared memory output has
+// the input size, and the client keeps the segments alive until the done
+// or error reply.
+class InpaintDaemon: public QObject
+{
+    Q_OBJECT
+
+public:
+    // concurrentJobs == 0 picks a value from the number of cores
+    InpaintDaemon(int concurrentJobs = 0, QObject* parent = 0);
+    ~InpaintDaemon();
+
+    void setFieldCache(const NnfCache* cache) { fieldCache_ = cache; }
+
+    bool listen(const QString& name);
+
+signals:
+    // from job threads, delivered to the socket in the daemon's thread
+    void replyReady(int client, QByteArray message);
+
+private slots:
+    void acceptClients();
+    void readRequests();
+    void dropClient();
+    void sendReply(int client, QByteArray message);
+
+private:
+    friend struct DaemonTask;
+
+    void run(const DaemonJob& job);
+    void progress(int client, qint32 id, int levelsDone, int levelCount);
+    void fail(const DaemonJob& job, const QString& error);
+
+    // prepared on first use, kept until the daemon goes away
+    const SourceLibrary* library(const QString& listFilename);
+
+    QLocalServer* server_;
+    QHash<int, QLocalSocket*> clients_;
+    QHash<QLocalSocket*, QByteArray> pending_;
+    int nextClient_;
+
+    QThreadPool computePool_;
+    QThreadPool passPool_;
+    int chunksPerJob_;
+
+    QMutex librariesMutex_;
+    QHash<QString, SourceLibrary*> libraries_;
+
+    const NnfCache* fieldCache_;
+};
+
+#endif
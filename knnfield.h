@@ -0,0 +1,140 @@
+#ifndef UNSEEIT_KNNFIELD_H
+#define UNSEEIT_KNNFIELD_H
+
+#include <climits>
+
+#include <QPoint>
+#include <QSize>
+#include <QVector>
+#include <QtGlobal>
+
+// k best distinct offsets for every pixel.
+//
+// Candidates of a pixel live in k consecutive slots and form a max-heap on
+// score, so the root is the worst of them and the acceptance threshold for
+// a new candidate. Unused slots have score INT_MAX.
+class KnnField
+{
+public:
+    KnnField(): w_(0), h_(0), k_(0) {}
+
+    KnnField(const QSize& sz, int k):
+        w_(sz.width()), h_(sz.height()), k_(k),
+        offsets_(w_*h_*k), scores_(w_*h_*k, INT_MAX)
+    {
+    }
+
+    int k() const { return k_; }
+    QSize size() const { return QSize(w_, h_); }
+
+    bool isNull() const {
+        return !(w_ && h_ && k_);
+    }
+
+    // makes sure later writes don't copy the data,
+    // call before writing from several threads
+    void detach() {
+        offsets_.data();
+        scores_.data();
+    }
+
+    QPoint* offsets(const QPoint& p) {
+        Q_ASSERT(p.x()>=0 && p.x()<w_ && p.y()>=0 && p.y()<h_);
+        return offsets_.data() + (p.y()*w_ + p.x())*k_;
+    }
+
+    const QPoint* offsets(const QPoint& p) const {
+        Q_ASSERT(p.x()>=0 && p.x()<w_ && p.y()>=0 && p.y()<h_);
+        return offsets_.constData() + (p.y()*w_ + p.x())*k_;
+    }
+
+    int* scores(const QPoint& p) {
+        Q_ASSERT(p.x()>=0 && p.x()<w_ && p.y()>=0 && p.y()<h_);
+        return scores_.data() + (p.y()*w_ + p.x())*k_;
+    }
+
+    const int* scores(const QPoint& p) const {
+        Q_ASSERT(p.x()>=0 && p.x()<w_ && p.y()>=0 && p.y()<h_);
+        return scores_.constData() + (p.y()*w_ + p.x())*k_;
+    }
+
+    // score a candidate has to beat to get in
+    int threshold(const QPoint& p) const {
+        return scores(p)[0];
+    }
+
+    // leaves a single candidate for p
+    void reset(const QPoint& p, const QPoint& offset, int score) {
+        QPoint* o = offsets(p);
+        int* s = scores(p);
+        for (int n=0; n<k_; ++n) {
+            o[n] = offset;
+            s[n] = INT_MAX;
+        }
+        // the last slot is a leaf, so the heap stays valid
+        s[k_-1] = score;
+    }
+
+    bool contains(const QPoint& p, const QPoint& offset) const {
+        return contains(offsets(p), scores(p), k_, offset);
+    }
+
+    // replaces the worst candidate if the new one is better and distinct
+    bool insert(const QPoint& p, const QPoint& offset, int score) {
+        return insert(offsets(p), scores(p), k_, offset, score);
+    }
+
+    int best(const QPoint& p, QPoint* offset) const {
+        return best(offsets(p), scores(p), k_, offset);
+    }
+
+    // raw heap operations, for working on a copy of a pixel's slots
+
+    static bool contains(const QPoint* o, const int* s, int k, const QPoint& offset) {
+        for (int n=0; n<k; ++n)
+            if (s[n] != INT_MAX && o[n] == offset)
+                return true;
+        return false;
+    }
+
+    static bool insert(QPoint* o, int* s, int k, const QPoint& offset, int score) {
+        if (score >= s[0] || contains(o, s, k, offset))
+            return false;
+
+        // replace the root and sift it down
+        int n = 0;
+        for (;;) {
+            int child = 2*n+1;
+            if (child >= k)
+                break;
+            if (child+1 < k && s[child+1] > s[child])
+                ++child;
+            if (s[child] <= score)
+                break;
+            s[n] = s[child];
+            o[n] = o[child];
+            n = child;
+        }
+        s[n] = score;
+        o[n] = offset;
+        return true;
+    }
+
+    static int best(const QPoint* o, const int* s, int k, QPoint* offset) {
+        int best_n = 0;
+        for (int n=1; n<k; ++n)
+            if (s[n] < s[best_n])
+                best_n = n;
+        *offset = o[best_n];
+        return s[best_n];
+    }
+
+private:
+    int w_;
+    int h_;
+    int k_;
+    QVector<QPoint> offsets_;
+    QVector<int> scores_;
+};
+
+#endif
@@ -1,14 +1,148 @@
 #include <QApplication>
+#include <QFile>
+#include <QScopedPointer>
+#include <QStringList>
+#include <QDebug>
 
+#include "batchqueue.h"
+#include "benchmark.h"
+#include "consts.h"
+#include "inpaintdaemon.h"
+#include "nnfcache.h"
+#include "sequenceinpainter.h"
+#include "shardedmapper.h"
+#include "sourcelibrary.h"
 #include "window.h"
 #include "patchmatchwindow.h"
 
+namespace {
+
+const int R = 4;
+
+bool loadLibrary(const QString& listFilename, SourceLibrary* library)
+{
+    if (!library->addList(listFilename))
+        return false;
+
+    library->prepare(LIBRARY_LEVEL_COUNT);
+    return library->sourceCount() > 0;
+}
+
+// UNSEEIT_PRESET is fast, balanced or best
+ResynthesizerPreset presetFromEnvironment()
+{
+    QByteArray name = qgetenv("UNSEEIT_PRESET");
+    if (name == "fast")
+        return RPresetFast;
+    if (name == "best")
+        return RPresetBest;
+    if (!name.isEmpty() && name != "balanced")
+        qDebug() << "unknown preset" << name << "using balanced";
+    return RPresetBalanced;
+}
+
+// every line of the list is "image mask output"
+int runBatch(const QString& listFilename, const QString& libraryFilename, NnfCache* cache)
+{
+    QFile list(listFilename);
+    if (!list.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qDebug() << "can't open" << listFilename;
+        return 1;
+    }
+
+    SourceLibrary library(R);
+    if (!libraryFilename.isEmpty() && !loadLibrary(libraryFilename, &library))
+        return 1;
+
+    BatchQueue queue;
+    if (library.sourceCount())
+        queue.setSourceLibrary(&library);
+    queue.setFieldCache(cache);
+    queue.setPreset(presetFromEnvironment());
+    // milliseconds of compute per job
+    queue.setTimeBudget(qgetenv("UNSEEIT_TIME_BUDGET").toInt());
+    if (qgetenv("UNSEEIT_INIT") == "onion")
+        queue.setInitMode(RInitOnionPeel);
+    queue.setSplitHoles(qgetenv("UNSEEIT_SPLIT_HOLES") == "1");
+    int jobCount = 0;
+
+    while (!list.atEnd()) {
+        QStringList fields = QString(list.readLine()).trimmed().split(" ", QString::SkipEmptyParts);
+        if (fields.isEmpty())
+            continue;
+        if (fields.size() != 3) {
+            qDebug() << "bad job line:" << fields;
+            continue;
+        }
+
+        InpaintJob job;
+        job.imagePath = fields[0];
+        job.maskPath = fields[1];
+        job.outputPath = fields[2];
+        queue.enqueue(job);
+        ++jobCount;
+    }
+
+    queue.waitForDone();
+
+    qDebug() << jobCount << "jobs done," << queue.failedCount() << "failed";
+    return queue.failedCount()?1:0;
+}
+
+};
+
 int main (int argc, char *argv[])
 {
+    // started by ShardedSimilarityMapper, no GUI
+    if (argc == 2 && QString(argv[1]) == "--shard-worker") {
+        QCoreApplication app(argc, argv);
+        return run_shard_worker();
+    }
+
+    // nearest neighbour fields are kept between runs when this is set
+    QScopedPointer<NnfCache> cache;
+    QByteArray cacheDir = qgetenv("UNSEEIT_NNF_CACHE");
+    if (!cacheDir.isEmpty())
+        cache.reset(new NnfCache(cacheDir));
+
+    // serves jobs until killed, no GUI either
+    if (argc == 3 && QString(argv[1]) == "--daemon") {
+        QCoreApplication app(argc, argv);
+        InpaintDaemon daemon;
+        daemon.setFieldCache(cache.data());
+        if (!daemon.listen(argv[2]))
+            return 1;
+        return app.exec();
+    }
+
     QApplication app(argc, argv);
 
+    if ((argc == 3 || argc == 4) && QString(argv[1]) == "--batch")
+        return runBatch(argv[2], (argc == 4)?argv[3]:"", cache.data());
+
+    if (argc >= 3 && QString(argv[1]) == "--benchmark") {
+        QList<int> budgets;
+        for (int n=3; n<argc; ++n)
+            budgets << QString(argv[n]).toInt();
+        return run_benchmark(argv[2], budgets);
+    }
+
+    if ((argc == 3 || argc == 4) && QString(argv[1]) == "--benchmark-layout")
+        return run_layout_benchmark(argv[2], (argc == 4)?QString(argv[3]).toInt():24);
+
+    if (argc == 5 && QString(argv[1]) == "--sequence") {
+        SequenceInpainter sequence;
+        return sequence.run(argv[2], argv[3], argv[4])?1:0;
+    }
+
     Window w;
+    w.setFieldCache(cache.data());
+    // split PatchMatch of large images over that many processes
+    int shardCount = qgetenv("UNSEEIT_SHARDS").toInt();
+    if (shardCount > 1)
+        w.setShardCount(shardCount);
     PatchMatchWindow pmw;
+    pmw.setFieldCache(cache.data());
 
     if (argc == 2) {
         w.loadImage(argv[1]);
@@ -21,4 +155,3 @@ int main (int argc, char *argv[])
 
     return app.exec();
 }
-
@@ -0,0 +1,165 @@
+#include "nnfcache.h"
+
+#include <string.h>
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QTemporaryFile>
+
+#include "utils.h"
+
+namespace {
+
+const char MAGIC[4] = {'U', 'N', 'N', 'F'};
+const quint32 VERSION = 1;
+
+struct Header
+{
+    char magic[4];
+    quint32 version;
+    qint32 width;
+    qint32 height;
+};
+
+bool write_data(QIODevice* device, const void* data, qint64 size)
+{
+    return device->write(reinterpret_cast<const char*>(data), size) == size;
+}
+
+bool read_data(QIODevice* device, void* data, qint64 size)
+{
+    return device->read(reinterpret_cast<char*>(data), size) == size;
+}
+
+void hashImage(QCryptographicHash* hash, const QImage& image)
+{
+    if (image.isNull())
+        return;
+
+    qint32 dims[3] = { image.width(), image.height(), image.format() };
+    hash->addData(reinterpret_cast<const char*>(dims), sizeof(dims));
+
+    // scanlines may be padded, hash only the pixels
+    int row_bytes = (image.width()*image.depth() + 7)/8;
+    for (int j=0; j<image.height(); ++j)
+        hash->addData(reinterpret_cast<const char*>(image.scanLine(j)), row_bytes);
+}
+
+};
+
+NnfCache::NnfCache(const QString& directory):
+    directory_(directory)
+{
+    QDir().mkpath(directory_);
+}
+
+QByteArray NnfCache::key(const QImage& src, const QImage& dst,
+    const QImage& srcMask, const QImage& dstMask)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hashImage(&hash, src);
+    hashImage(&hash, dst);
+    hashImage(&hash, srcMask);
+    hashImage(&hash, dstMask);
+    return hash.result().toHex();
+}
+
+QString NnfCache::path(const QByteArray& key, int level) const
+{
+    return QDir(directory_).filePath(QString("%1_%2.nnf").arg(QString(key)).arg(level));
+}
+
+bool NnfCache::load(const QByteArray& key, int level, NnField* field) const
+{
+    TRACE_ME
+
+    QFile file(path(key, level));
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    Header header;
+    if (!read_data(&file, &header, sizeof(header)))
+        return false;
+
+    qint64 pixels = (qint64)header.width*header.height;
+    qint64 expected_size = sizeof(Header) + pixels*(2*sizeof(qint32) + sizeof(qint32) + sizeof(float));
+
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) || header.version != VERSION ||
+        header.width <= 0 || header.height <= 0 || file.size() != expected_size) {
+        qDebug() << "bad nnf file" << file.fileName();
+        return false;
+    }
+
+    // the arrays are laid out like the matrices, QPoint is two ints;
+    // reliabilities are stored as floats
+    NnField loaded;
+    loaded.offsets = COWMatrix<QPoint>(header.width, header.height);
+    loaded.scores = COWMatrix<int>(header.width, header.height);
+    loaded.reliabilities = COWMatrix<qreal>(header.width, header.height);
+    QVector<float> reliabilities(pixels);
+    if (!read_data(&file, loaded.offsets.ptrAt(0, 0), pixels*2*sizeof(qint32)) ||
+        !read_data(&file, loaded.scores.ptrAt(0, 0), pixels*sizeof(qint32)) ||
+        !read_data(&file, reliabilities.data(), pixels*sizeof(float))) {
+        qDebug() << "can't read" << file.fileName();
+        return false;
+    }
+    for (int j=0; j<header.height; ++j)
+        for (int i=0; i<header.width; ++i)
+            loaded.reliabilities.set(i, j, reliabilities[j*header.width+i]);
+
+    *field = loaded;
+    return true;
+}
+
+bool NnfCache::store(const QByteArray& key, int level, const NnField& field) const
+{
+    TRACE_ME
+
+    int w = field.offsets.width();
+    int h = field.offsets.height();
+
+    QVector<qint32> offsets(2*w*h);
+    QVector<qint32> scores(w*h);
+    QVector<float> reliabilities(w*h);
+    for (int j=0; j<h; ++j)
+        for (int i=0; i<w; ++i) {
+            int idx = j*w+i;
+            offsets[2*idx] = field.offsets.get(i, j).x();
+            offsets[2*idx+1] = field.offsets.get(i, j).y();
+            scores[idx] = field.scores.get(i, j);
+            reliabilities[idx] = field.reliabilities.get(i, j);
+        }
+
+    Header header;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.width = w;
+    header.height = h;
+
+    // write to a temporary file of this writer's own first, readers never
+    // see half a field and concurrent writers don't mix theirs
+    QString filename = path(key, level);
+    QTemporaryFile file(filename + ".tmp.XXXXXX");
+    if (!file.open())
+        return false;
+
+    bool ok =
+        write_data(&file, &header, sizeof(header)) &&
+        write_data(&file, offsets.constData(), offsets.size()*sizeof(qint32)) &&
+        write_data(&file, scores.constData(), scores.size()*sizeof(qint32)) &&
+        write_data(&file, reliabilities.constData(), reliabilities.size()*sizeof(float)) &&
+        file.flush();
+    if (!ok) {
+        qDebug() << "can't write" << file.fileName();
+        return false;
+    }
+    file.close();
+
+    // the old field stays until the new one is complete
+    QFile::remove(filename);
+    if (!QFile::rename(file.fileName(), filename))
+        return false;
+    file.setAutoRemove(false);
+    return true;
+}
@@ -0,0 +1,51 @@
+#ifndef UNSEEIT_NNFCACHE_H
+#define UNSEEIT_NNFCACHE_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QString>
+
+#include "cowmatrix.h"
+
+// Nearest neighbour field of one pyramid level.
+struct NnField
+{
+    COWMatrix<QPoint> offsets;
+    COWMatrix<int> scores;
+    COWMatrix<qreal> reliabilities;
+
+    bool isNull() const { return offsets.isNull(); }
+};
+
+// On-disk cache of nearest neighbour fields, for warm starts when the
+// same dst/src pair is run again.
+//
+// Every level goes to its own file named after the key and the level:
+//
+//   "UNNF", quint32 version, qint32 width, qint32 height
+//   width*height qint32 pairs of offsets
+//   width*height qint32 scores
+//   width*height float reliabilities
+//
+// in native byte order, laid out like the matrices, so loading a level
+// is one read per array straight into a new matrix. The file is loaded,
+// not mapped: the field is copied into the mapper right away anyway.
+class NnfCache
+{
+public:
+    NnfCache(const QString& directory);
+
+    // content hash of the inputs, any null image is skipped
+    static QByteArray key(const QImage& src, const QImage& dst,
+        const QImage& srcMask = QImage(), const QImage& dstMask = QImage());
+
+    bool load(const QByteArray& key, int level, NnField* field) const;
+    bool store(const QByteArray& key, int level, const NnField& field) const;
+
+private:
+    QString path(const QByteArray& key, int level) const;
+
+    QString directory_;
+};
+
+#endif
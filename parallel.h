@@ -0,0 +1,69 @@
+#ifndef UNSEEIT_PARALLEL_H
+#define UNSEEIT_PARALLEL_H
+
+#include <QAtomicInt>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QSharedPointer>
+#include <QThreadPool>
+
+namespace parallel_detail {
+
+template <typename F>
+struct ChunkState
+{
+    ChunkState(F f, int count): func(f), chunkCount(count), nextChunk(0) {}
+
+    // grab chunks until none are left, returns number of chunks done
+    int drain() {
+        int done = 0;
+        for (int i = nextChunk.fetchAndAddOrdered(1); i < chunkCount;
+                i = nextChunk.fetchAndAddOrdered(1)) {
+            func(i);
+            ++done;
+        }
+        return done;
+    }
+
+    F func;
+    int chunkCount;
+    QAtomicInt nextChunk;
+    QSemaphore finished;
+};
+
+template <typename F>
+struct ChunkRunnable: public QRunnable
+{
+    ChunkRunnable(const QSharedPointer<ChunkState<F> >& state): state_(state) {}
+
+    void run() {
+        state_->finished.release(state_->drain());
+    }
+
+private:
+    QSharedPointer<ChunkState<F> > state_;
+};
+
+};
+
+// Calls f(0) .. f(chunkCount-1) on the given pool and blocks until all
+// of them are done. The calling thread takes chunks too, so this never
+// deadlocks when called from a thread of the same (saturated) pool.
+template <typename F>
+void parallel_for_chunks(QThreadPool* pool, int chunkCount, F f)
+{
+    using namespace parallel_detail;
+
+    if (chunkCount <= 0)
+        return;
+
+    QSharedPointer<ChunkState<F> > state(new ChunkState<F>(f, chunkCount));
+
+    for (int i=1; i<chunkCount; ++i)
+        pool->start(new ChunkRunnable<F>(state));
+
+    state->finished.release(state->drain());
+    state->finished.acquire(chunkCount);
+}
+
+#endif
@@ -0,0 +1,279 @@
+#include "patchindex.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <QtGlobal>
+#include <qmath.h>
+
+#include "utils.h"
+
+namespace {
+
+const int LEAF_SIZE = 8;
+const int PCA_SAMPLE_COUNT = 4096;
+const int POWER_ITERATIONS = 64;
+
+struct AxisLess
+{
+    AxisLess(const QVector<float>& descriptors, int axis):
+        descriptors_(descriptors), axis_(axis) {}
+
+    bool operator()(int a, int b) const {
+        return descriptors_[a*PatchIndex::DESCRIPTOR_DIM + axis_] <
+               descriptors_[b*PatchIndex::DESCRIPTOR_DIM + axis_];
+    }
+
+    const QVector<float>& descriptors_;
+    int axis_;
+};
+
+};
+
+PatchIndex::PatchIndex(int r):
+    r_(r), blockSize_((2*r+1)/3)
+{
+    Q_ASSERT((2*r+1)%3 == 0);
+}
+
+void PatchIndex::build(const ImageView& src, const BitMask& srcMask)
+{
+    TRACE_ME
+
+    centres_.clear();
+    descriptors_.clear();
+    nodes_.clear();
+
+    for (int j=r_; j<src.height()-r_; ++j)
+        for (int i=r_; i<src.width()-r_; ++i)
+            if (srcMask.isNull() || srcMask.test(i, j))
+                centres_ << QPoint(i, j);
+
+    if (centres_.isEmpty())
+        return;
+
+    // PCA on an evenly strided sample of block descriptors
+    int sample_count = qMin(PCA_SAMPLE_COUNT, centres_.size());
+    int stride = centres_.size()/sample_count;
+    QVector<float> samples(sample_count*BLOCK_DIM);
+    for (int s=0; s<sample_count; ++s)
+        blockDescriptor(src, centres_[s*stride], samples.data() + s*BLOCK_DIM);
+    computeProjection(samples, sample_count);
+
+    descriptors_.resize(centres_.size()*DESCRIPTOR_DIM);
+    float block[BLOCK_DIM];
+    for (int c=0; c<centres_.size(); ++c) {
+        blockDescriptor(src, centres_[c], block);
+        project(block, descriptors_.data() + c*DESCRIPTOR_DIM);
+    }
+
+    QVector<int> order(centres_.size());
+    for (int c=0; c<order.size(); ++c)
+        order[c] = c;
+
+    buildNode(&order, 0, order.size());
+
+    // store centres in tree order, so leaves are contiguous ranges
+    QVector<QPoint> centres(centres_.size());
+    QVector<float> descriptors(descriptors_.size());
+    for (int c=0; c<order.size(); ++c) {
+        centres[c] = centres_[order[c]];
+        std::copy(descriptors_.begin() + order[c]*DESCRIPTOR_DIM,
+                  descriptors_.begin() + (order[c]+1)*DESCRIPTOR_DIM,
+                  descriptors.begin() + c*DESCRIPTOR_DIM);
+    }
+    centres_ = centres;
+    descriptors_ = descriptors;
+
+    qDebug() << centres_.size() << "source patches indexed in" << nodes_.size() << "nodes";
+}
+
+void PatchIndex::describe(const ImageView& img, QPoint p, float* descriptor) const
+{
+    float block[BLOCK_DIM];
+    blockDescriptor(img, p, block);
+    project(block, descriptor);
+}
+
+int PatchIndex::query(const float* descriptor, int k, int maxLeaves, QPoint* result) const
+{
+    if (nodes_.isEmpty())
+        return 0;
+
+    QVector<Neighbour> best;
+    best.reserve(k+1);
+    int leaves_left = maxLeaves;
+    searchNode(0, descriptor, k, &leaves_left, &best);
+
+    for (int n=0; n<best.size(); ++n)
+        result[n] = centres_[best[n].second];
+    return best.size();
+}
+
+void PatchIndex::blockDescriptor(const ImageView& img, QPoint p, float* block) const
+{
+    float inv_area = 1.f/(blockSize_*blockSize_);
+
+    for (int bj=0; bj<3; ++bj)
+        for (int bi=0; bi<3; ++bi) {
+            int r = 0, g = 0, b = 0;
+            int x0 = p.x() - r_ + bi*blockSize_;
+            int y0 = p.y() - r_ + bj*blockSize_;
+            for (int j=y0; j<y0+blockSize_; ++j) {
+                const QRgb* pixels = img.scanLine(j);
+                for (int i=x0; i<x0+blockSize_; ++i) {
+                    QRgb c = pixels[i];
+                    r += qRed(c);
+                    g += qGreen(c);
+                    b += qBlue(c);
+                }
+            }
+            *block++ = r*inv_area;
+            *block++ = g*inv_area;
+            *block++ = b*inv_area;
+        }
+}
+
+void PatchIndex::project(const float* block, float* descriptor) const
+{
+    for (int d=0; d<DESCRIPTOR_DIM; ++d) {
+        float v = 0;
+        for (int i=0; i<BLOCK_DIM; ++i)
+            v += (block[i] - mean_[i])*axes_[d][i];
+        descriptor[d] = v;
+    }
+}
+
+void PatchIndex::computeProjection(const QVector<float>& samples, int sampleCount)
+{
+    for (int i=0; i<BLOCK_DIM; ++i) {
+        double sum = 0;
+        for (int s=0; s<sampleCount; ++s)
+            sum += samples[s*BLOCK_DIM + i];
+        mean_[i] = sum/sampleCount;
+    }
+
+    double cov[BLOCK_DIM][BLOCK_DIM];
+    for (int a=0; a<BLOCK_DIM; ++a)
+        for (int b=a; b<BLOCK_DIM; ++b) {
+            double sum = 0;
+            for (int s=0; s<sampleCount; ++s)
+                sum += (samples[s*BLOCK_DIM + a] - mean_[a])*(samples[s*BLOCK_DIM + b] - mean_[b]);
+            cov[a][b] = cov[b][a] = sum/sampleCount;
+        }
+
+    // power iteration with deflation, the matrix is tiny
+    for (int d=0; d<DESCRIPTOR_DIM; ++d) {
+        double v[BLOCK_DIM];
+        for (int i=0; i<BLOCK_DIM; ++i)
+            v[i] = 1.0 + 0.01*i;
+
+        double eigenvalue = 0;
+        for (int it=0; it<POWER_ITERATIONS; ++it) {
+            double next[BLOCK_DIM];
+            double norm = 0;
+            for (int a=0; a<BLOCK_DIM; ++a) {
+                next[a] = 0;
+                for (int b=0; b<BLOCK_DIM; ++b)
+                    next[a] += cov[a][b]*v[b];
+                norm += next[a]*next[a];
+            }
+            norm = qSqrt(norm);
+            if (norm < 1e-12)
+                break;
+            for (int a=0; a<BLOCK_DIM; ++a)
+                v[a] = next[a]/norm;
+            eigenvalue = norm;
+        }
+
+        for (int i=0; i<BLOCK_DIM; ++i)
+            axes_[d][i] = v[i];
+
+        for (int a=0; a<BLOCK_DIM; ++a)
+            for (int b=0; b<BLOCK_DIM; ++b)
+                cov[a][b] -= eigenvalue*v[a]*v[b];
+    }
+}
+
+int PatchIndex::buildNode(QVector<int>* order, int begin, int end)
+{
+    int index = nodes_.size();
+    nodes_.push_back(Node());
+
+    Node node;
+    node.begin = begin;
+    node.end = end;
+    node.left = node.right = -1;
+    node.axis = -1;
+    node.split = 0;
+
+    if (end - begin > LEAF_SIZE) {
+        // split along the axis with the largest spread
+        float best_spread = -1;
+        for (int d=0; d<DESCRIPTOR_DIM; ++d) {
+            float lo = std::numeric_limits<float>::max();
+            float hi = -lo;
+            for (int i=begin; i<end; ++i) {
+                float v = descriptors_[(*order)[i]*DESCRIPTOR_DIM + d];
+                lo = qMin(lo, v);
+                hi = qMax(hi, v);
+            }
+            if (hi - lo > best_spread) {
+                best_spread = hi - lo;
+                node.axis = d;
+            }
+        }
+
+        int mid = (begin + end)/2;
+        std::nth_element(order->begin() + begin, order->begin() + mid,
+            order->begin() + end, AxisLess(descriptors_, node.axis));
+        node.split = descriptors_[(*order)[mid]*DESCRIPTOR_DIM + node.axis];
+
+        node.left = buildNode(order, begin, mid);
+        node.right = buildNode(order, mid, end);
+    }
+
+    nodes_[index] = node;
+    return index;
+}
+
+void PatchIndex::searchNode(int node_index, const float* q, int k, int* leavesLeft,
+    QVector<Neighbour>* best) const
+{
+    const Node& node = nodes_[node_index];
+
+    if (node.axis < 0) {
+        for (int i=node.begin; i<node.end; ++i) {
+            const float* d = descriptors_.constData() + i*DESCRIPTOR_DIM;
+            float dist = 0;
+            for (int a=0; a<DESCRIPTOR_DIM; ++a)
+                dist += (d[a]-q[a])*(d[a]-q[a]);
+
+            if (best->size() == k && dist >= best->last().first)
+                continue;
+
+            // keep best sorted, it's only k long
+            Neighbour n(dist, i);
+            int pos = best->size();
+            best->push_back(n);
+            while (pos > 0 && (*best)[pos-1].first > dist) {
+                (*best)[pos] = (*best)[pos-1];
+                --pos;
+            }
+            (*best)[pos] = n;
+            if (best->size() > k)
+                best->pop_back();
+        }
+        --*leavesLeft;
+        return;
+    }
+
+    float diff = q[node.axis] - node.split;
+    int near_child = (diff < 0)?node.left:node.right;
+    int far_child  = (diff < 0)?node.right:node.left;
+
+    searchNode(near_child, q, k, leavesLeft, best);
+
+    if (*leavesLeft > 0 && (best->size() < k || diff*diff < best->last().first))
+        searchNode(far_child, q, k, leavesLeft, best);
+}
@@ -0,0 +1,77 @@
+#ifndef UNSEEIT_PATCHINDEX_H
+#define UNSEEIT_PATCHINDEX_H
+
+#include <QImage>
+#include <QPair>
+#include <QPoint>
+#include <QVector>
+
+#include "bitmask.h"
+#include "imageview.h"
+
+// Approximate nearest neighbour search over source patches.
+//
+// Every (2r+1)x(2r+1) patch is reduced to 3x3 blocks of mean RGB colour
+// (27 numbers), which PCA then projects to DESCRIPTOR_DIM dimensions.
+// The projected descriptors of all valid source centres go into a kd-tree.
+class PatchIndex
+{
+public:
+    enum {
+        BLOCK_DIM = 27,
+        DESCRIPTOR_DIM = 8
+    };
+
+    // (2r+1) must be divisible by 3
+    PatchIndex(int r);
+
+    // src - argb32, srcMask - valid centres, null means every centre
+    // far enough from the edges is a valid source
+    void build(const ImageView& src, const BitMask& srcMask);
+
+    bool isEmpty() const { return centres_.isEmpty(); }
+    int size() const { return centres_.size(); }
+
+    // projected descriptor of the patch centred at p, p must be at least
+    // r pixels away from the edges
+    void describe(const ImageView& img, QPoint p, float* descriptor) const;
+
+    // writes up to k source centres with descriptors close to the given one
+    // to result, visits at most maxLeaves tree leaves, returns the count
+    int query(const float* descriptor, int k, int maxLeaves, QPoint* result) const;
+
+private:
+    struct Node
+    {
+        // leaf if axis < 0, then [begin, end) is the range of centres
+        int axis;
+        float split;
+        int begin;
+        int end;
+        int left;
+        int right;
+    };
+
+    typedef QPair<float, int> Neighbour;
+
+    void blockDescriptor(const ImageView& img, QPoint p, float* block) const;
+    void project(const float* block, float* descriptor) const;
+    void computeProjection(const QVector<float>& samples, int sampleCount);
+    int buildNode(QVector<int>* order, int begin, int end);
+    void searchNode(int node, const float* q, int k, int* leavesLeft,
+        QVector<Neighbour>* best) const;
+
+    int r_;
+    int blockSize_;
+
+    // mean and principal axes of block descriptors
+    float mean_[BLOCK_DIM];
+    float axes_[DESCRIPTOR_DIM][BLOCK_DIM];
+
+    QVector<QPoint> centres_;
+    // DESCRIPTOR_DIM floats per centre, in the same order as centres_
+    QVector<float> descriptors_;
+    QVector<Node> nodes_;
+};
+
+#endif
@@ -3,15 +3,30 @@
 #include <QKeyEvent>
 #include <QtConcurrentRun>
 
+#include "nnfcache.h"
 #include "similaritymapper.h"
 #include "utils.h"
 
 #include <qmath.h>
 
 const int R = 4;
+const int WARM_PASS_COUNT = 2;
+
+namespace {
+
+COWMatrix<QPoint> iterateAndStore(SimilarityMapper* sm, QImage dst,
+    NnfCache* cache, QByteArray key)
+{
+    COWMatrix<QPoint> result = sm->iterate(dst);
+    if (cache)
+        cache->store(key, 0, sm->field());
+    return result;
+}
+
+};
 
 PatchMatchWindow::PatchMatchWindow(QWidget* parent): QWidget(parent),
-    srcImage_(NULL), dstImage_(NULL)
+    dstImage_(NULL), srcImage_(NULL), fieldCache_(NULL)
 {
     srcLabel_ = new QLabel(this);
     srcLabel_->setGeometry(0, 0, 500, 500);
@@ -51,7 +66,10 @@ void PatchMatchWindow::keyReleaseEvent(QKeyEvent* evt)
 {
     switch (evt->key()) {
         case Qt::Key_Return:
-            launch();
+            launch(SMEnginePatchMatch);
+            break;
+        case Qt::Key_I:
+            launch(SMEngineDescriptorIndex);
             break;
     }
 }
@@ -74,7 +92,7 @@ void PatchMatchWindow::onIterationComplete(COWMatrix<QPoint> offsetMap,
     update();
 }
 
-void PatchMatchWindow::launch()
+void PatchMatchWindow::launch(SimilarityMapperEngine engine)
 {
     TRACE_ME
 
@@ -86,8 +104,22 @@ void PatchMatchWindow::launch()
     connect(sm_, SIGNAL(iterationComplete(COWMatrix<QPoint>, COWMatrix<qreal>)),
             this, SLOT(onIterationComplete(COWMatrix<QPoint>, COWMatrix<qreal>)));
 
+    sm_->setEngine(engine);
     sm_->init(*srcImage_, *dstImage_);
-    QFuture<COWMatrix<QPoint>> offsetMapFuture = QtConcurrent::run(sm_, &SimilarityMapper::iterate, *dstImage_);
+
+    QByteArray key;
+    if (fieldCache_) {
+        key = NnfCache::key(*srcImage_, *dstImage_);
+        NnField cached;
+        if (fieldCache_->load(key, 0, &cached) && cached.offsets.size() == dstImage_->size()) {
+            qDebug() << "warm start from cached field";
+            sm_->restore(cached);
+            sm_->setPassCount(WARM_PASS_COUNT);
+        }
+    }
+
+    QFuture<COWMatrix<QPoint>> offsetMapFuture = QtConcurrent::run(iterateAndStore,
+            sm_, *dstImage_, fieldCache_, key);
 
     // auto offsetMap = offsetMapFuture.result();
     // QImage offsetMapVisual = visualizeOffsetMap(offsetMap);
@@ -6,8 +6,9 @@
 #include <QImage>
 
 #include "cowmatrix.h"
+#include "similaritymapper.h"
 
-class SimilarityMapper;
+class NnfCache;
 
 class PatchMatchWindow: public QWidget
 {
@@ -20,6 +21,8 @@ public:
     void loadDst(QString filename);
     void loadSrc(QString filename);
 
+    void setFieldCache(NnfCache* cache) { fieldCache_ = cache; }
+
 protected:
     void keyReleaseEvent(QKeyEvent* evt);
 
@@ -28,7 +31,7 @@ private slots:
                              COWMatrix<qreal> reliabilityMap);
 
 private:
-    void launch();
+    void launch(SimilarityMapperEngine engine);
     QImage applyOffsetsWeighted(const COWMatrix<QPoint>& offsetMap, const COWMatrix<qreal>& relMap);
     QImage applyOffsetsUnweighted(const COWMatrix<QPoint>& offsetMap);
 
@@ -42,6 +45,7 @@ private:
     QLabel* resultLabel_;
 
     SimilarityMapper* sm_;
+    NnfCache* fieldCache_;
 };
 
 #endif /* end of include guard: PATCHMATCHWINDOW_H_NKL1CREY */
@@ -1,30 +1,26 @@
 #include "randomoffsetgenerator.h"
 
-RandomOffsetGenerator::RandomOffsetGenerator(const QImage& realMap, int r):
+RandomOffsetGenerator::RandomOffsetGenerator(const BitMask& realMap, int r):
     width_(realMap.width()),
     height_(realMap.height()),
-    bitmap_(realMap) {
-    for (int d=0; d<r; ++d) {
-        for (int i=0; i<bitmap_.width(); ++i) {
-            bitmap_.setPixel(i, d, 0);
-            bitmap_.setPixel(i, bitmap_.height()-d-1, 0);
-        }
-        for (int j=0; j<bitmap_.height(); ++j) {
-            bitmap_.setPixel(d, j, 0);
-            bitmap_.setPixel(bitmap_.width()-d-1, j, 0);
-        }
-    }
+    bitmap_(realMap.withoutBorder(r)),
+    empty_(bitmap_.isEmpty()) {
 }
 
 QPoint RandomOffsetGenerator::operator()(QPoint p) {
     int rand_x, rand_y;
 
+    // nothing to draw from, Resynthesizer checks for valid sources
+    // before; an offset to p itself gets rejected as a source later
+    if (empty_)
+        return QPoint(0, 0);
+
     // TODO: more effective strategy for sparse real map
 
     do {
         rand_x = qrand()%width_;
         rand_y = qrand()%height_;
-    } while (!bitmap_.pixelIndex(rand_x, rand_y));
+    } while (!bitmap_.test(rand_x, rand_y));
 
     return QPoint(rand_x, rand_y) - p;
 }
@@ -1,12 +1,16 @@
 #ifndef UNSEEIT_RANDOM_OFFSET_GENERATOR_H
 #define UNSEEIT_RANDOM_OFFSET_GENERATOR_H
 
-#include <QImage>
+#include <QPoint>
+
+#include "bitmask.h"
 
 struct RandomOffsetGenerator
 {
 
-    RandomOffsetGenerator(const QImage& realMap, int r);
+    // realMap pixels at least r away from the edges are drawn,
+    // with none every offset is (0, 0)
+    RandomOffsetGenerator(const BitMask& realMap, int r);
 
     QPoint operator()(QPoint p);
     QPoint operator()(int x, int y);
@@ -14,7 +18,8 @@ struct RandomOffsetGenerator
 private:
     int width_;
     int height_;
-    QImage bitmap_;
+    BitMask bitmap_;
+    bool empty_;
 };
 
 #endif
@@ -2,129 +2,670 @@
 
 #include <QColor>
 #include <QDebug>
+#include <QMutexLocker>
+#include <QThreadPool>
 #include <QVector>
 #include <QtGlobal>
 #include <algorithm>
 #include <iostream>
 #include <qmath.h>
 
+#include <boost/bind/bind.hpp>
+
+#include "consts.h"
+#include "nnfcache.h"
+#include "parallel.h"
 #include "pixel.h"
 #include "randomoffsetgenerator.h"
+#include "shardedmapper.h"
 #include "similaritymapper.h"
+#include "sourcelibrary.h"
 #include "utils.h"
 
 const int R = 4;
-const int PASS_COUNT = 50;
-const int LOD_MAX = 3;
 
 namespace {
 
-// propagate 0s in mono QImage
-QImage grow_selection(QImage arg)
-{
-    QRect bounds(QPoint(0, 0), arg.size());
-    QImage result = arg;
-    QPolygon offsets;
-    offsets << QPoint(0, 1) << QPoint(1, 0) << QPoint(-1, 0) << QPoint(0, -1);
-    for (int j=0; j<arg.height(); ++j)
-        for (int i=0; i<arg.width(); ++i) {
-            QPoint p(i, j);
-            foreach(QPoint o, offsets)
-                if (bounds.contains(p+o) && !arg.pixelIndex(p+o))
-                    result.setPixel(p, 0);
+// levels below this side length have too few patches to search
+const int MIN_LOD_SIDE = 32;
+
+struct PresetSettings
+{
+    // deepest pyramid, the depth is picked from the hole size
+    int lodLimit;
+    // EM iterations per level
+    int passCount;
+    // PatchMatch passes per EM iteration
+    int mapperPassCount;
+    double convergence;
+};
+
+// indexed by ResynthesizerPreset
+const PresetSettings PRESETS[] = {
+    { 3, 8, 4, 0.98 },
+    { 6, 50, 12, 0.995 },
+    { 6, 100, 16, 0.999 }
+};
+
+};
+
+// cached fields and fields of the previous frame are close to converged
+const int WARM_PASS_COUNT = 3;
+const int WARM_MAPPER_PASS_COUNT = 2;
+
+// split holes take at least that much of their surroundings as source,
+// or twice their size
+const int MIN_COMPONENT_CONTEXT = 64;
+
+// onion peel init tries that many random sources per pixel
+// besides the offsets of its filled neighbours
+const int ONION_RANDOM_CANDIDATES = 8;
+
+namespace {
+
+// mean squared difference between the known pixels of the patch around p
+// and the patch around s in source, scaled up by the inverse of the known
+// fraction, so a match on a few pixels doesn't beat one on most of them;
+// INT_MAX if none of them is known. s has to be at least R pixels away
+// from the edges of source
+int known_patch_distance(const QImage& image, const BitMask& known, QPoint p,
+                         const QImage& source, QPoint s)
+{
+    qint64 sum = 0;
+    int count = 0;
+
+    for (int dy=-R; dy<=R; ++dy) {
+        int y = p.y()+dy;
+        if (y < 0 || y >= image.height())
+            continue;
+
+        const quint8* line = image.scanLine(y);
+        const quint8* source_line = source.scanLine(s.y()+dy);
+        for (int dx=-R; dx<=R; ++dx) {
+            int x = p.x()+dx;
+            if (x < 0 || x >= image.width() || !known.test(x, y))
+                continue;
+            sum += ssd4(line + 4*x, source_line + 4*(s.x()+dx));
+            ++count;
         }
-    return result;
+    }
+
+    const qint64 area = (2*R+1)*(2*R+1);
+    return count?int(sum*area/((qint64)count*count)):INT_MAX;
+}
+
+// patches of sources at the edges stick out of the image, outside
+// pixels repeat the edge like the mapper's padded images
+inline QRgb clamped_pixel(const QImage& image, QPoint p)
+{
+    return image.pixel(qBound(0, p.x(), image.width()-1), qBound(0, p.y(), image.height()-1));
+}
+
+// p+o is a valid source centre and o is within the displacement limit
+bool is_valid_offset(const BitMask& sources, QPoint p, QPoint o, int maxDisplacement)
+{
+    if (maxDisplacement >= 0 && (qAbs(o.x()) > maxDisplacement || qAbs(o.y()) > maxDisplacement))
+        return false;
+    return sources.contains(p+o) && sources.test(p+o);
 }
 
 };
 
+Resynthesizer::Resynthesizer():
+    inputTexture_(NULL), sourceTexture_(NULL),
+    pool_(QThreadPool::globalInstance()), chunkCount_(JOB_CHUNK_COUNT),
+    engine_(SMEnginePatchMatch), weights_(SMWeightsDouble),
+    layout_(SMLayoutRowMajor), neighbourCount_(1),
+    shardCount_(1), splitHoles_(false), initMode_(RInitRandom), maxDisplacement_(-1),
+    timeBudget_(0), levelDeadline_(-1),
+    library_(NULL), lodLevel_(0), warmHint_(false),
+    fieldCache_(NULL)
+{
+    setPreset(RPresetBalanced);
+}
+
+void Resynthesizer::setPreset(ResynthesizerPreset preset)
+{
+    const PresetSettings& settings = PRESETS[preset];
+    lodLimit_ = settings.lodLimit;
+    passCount_ = settings.passCount;
+    mapperPassCount_ = settings.mapperPassCount;
+    convergence_ = settings.convergence;
+}
+
+void Resynthesizer::setThreadPool(QThreadPool* pool, int chunkCount)
+{
+    pool_ = pool;
+    chunkCount_ = chunkCount;
+}
 
 QImage Resynthesizer::inpaintHier(const QImage& inputTexture,
                               const QImage& outputMap)
 {
+    return inpaintHier(inputTexture, BitMask::fromImage(outputMap));
+}
+
+QImage Resynthesizer::inpaintHier(const QImage& inputTexture,
+                              const BitMask& holes)
+{
+    if (splitHoles_) {
+        // holes closer than a patch share patches, they stay together
+        COWMatrix<int> labels;
+        QVector<QRect> components = connected_components(holes.dilated(R), &labels);
+        if (components.size() > 1)
+            return inpaintComponents(inputTexture, holes, labels, components);
+    }
+
     bool first_pass = true;
     COWMatrix<QPoint> lodOffsetMap;
 
-    for (int lod_level=LOD_MAX; lod_level>=0; --lod_level) {
-        QSize lodSize = inputTexture.size()/(1<<lod_level);
+    if (fieldCache_)
+        cacheKey_ = NnfCache::key(library_?library_->atlas(0):QImage(), inputTexture,
+                library_?library_->atlasMask(0).toImage():QImage(), holes.toImage());
 
-        if (!first_pass)
-            lodOffsetMap = resize_offset_map(lodOffsetMap, lodSize);
+    int lod_max = lodMaxFor(holes);
+    if (library_)
+        lod_max = qMin(lod_max, library_->levelCount()-1);
 
-        QImage lodInputTexture = inputTexture.scaled(lodSize,
-                Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
-        QImage lodOutputMap = outputMap.scaled(lodSize,
+    clock_.start();
+
+    // every level scaled from the next finer one rather than all of them
+    // from the full image
+    QVector<QImage> pyramid(lod_max+1);
+    pyramid[0] = inputTexture;
+    for (int lod_level=1; lod_level<=lod_max; ++lod_level)
+        pyramid[lod_level] = pyramid[lod_level-1].scaled(lod_size(inputTexture.size(), lod_level),
                 Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
 
-        lodOffsetMap = buildOffsetMap(lodInputTexture, lodOutputMap,
+    for (int lod_level=lod_max; lod_level>=0; --lod_level) {
+        lodLevel_ = lod_level;
+        QSize lodSize = lod_size(inputTexture.size(), lod_level);
+
+        if (timeBudget_) {
+            // a level costs about its pixel count, what is left of the
+            // budget goes to this level and the finer ones accordingly
+            qint64 area = qint64(lodSize.width())*lodSize.height();
+            qint64 remaining_area = 0;
+            for (int l=lod_level; l>=0; --l) {
+                QSize size = lod_size(inputTexture.size(), l);
+                remaining_area += qint64(size.width())*size.height();
+            }
+            int now = clock_.elapsed();
+            int remaining = qMax(0, timeBudget_ - now);
+            levelDeadline_ = now + int(remaining*area/qMax(qint64(1), remaining_area));
+        }
+
+        if (!first_pass)
+            lodOffsetMap = resize_offset_map(lodOffsetMap, lodSize);
+
+        lodOffsetMap = buildOffsetMap(pyramid[lod_level], holes.scaled(lodSize),
                first_pass?COWMatrix<QPoint>():lodOffsetMap);
 
         if (first_pass)
             first_pass = false;
 
-        outputTexture_.save(QString("tmp/lod_%1.png").arg(lod_level));
+        if (progress_)
+            progress_(lod_max - lod_level + 1, lod_max + 1);
+    }
+    lodLevel_ = 0;
+    levelDeadline_ = -1;
+    cacheKey_.clear();
+    return outputTexture_;
+}
+
+QImage Resynthesizer::inpaintComponents(const QImage& inputTexture, const BitMask& holes,
+                      const COWMatrix<int>& labels, const QVector<QRect>& components)
+{
+    TRACE_ME
+
+    clock_.start();
+
+    QVector<ComponentJob> jobs(components.size());
+    for (int c=0; c<jobs.size(); ++c) {
+        QRect bounds = components[c];
+        int context = qMax(MIN_COMPONENT_CONTEXT, 2*qMax(bounds.width(), bounds.height()));
+
+        // packed holes can leave a crop without a patch to copy,
+        // the crop grows until there is one
+        for (;;) {
+            QRect roi = bounds.adjusted(-context, -context, context, context) & inputTexture.rect();
+            jobs[c] = componentJob(holes, labels, c, roi);
+            if (hasSourcePatch(jobs[c]))
+                break;
+
+            if (roi == inputTexture.rect()) {
+                qDebug() << "hole" << c << "has no source patches of its own, filling holes together";
+                splitHoles_ = false;
+                QImage result = inpaintHier(inputTexture, holes);
+                splitHoles_ = true;
+                return result;
+            }
+            context *= 2;
+        }
+    }
+
+    qDebug() << jobs.size() << "separate holes";
+
+    int done = 0;
+    QMutex progress_mutex;
+    parallel_for_chunks(pool_, jobs.size(),
+            boost::bind(&Resynthesizer::inpaintComponent, this, &inputTexture,
+                jobs.data(), jobs.size(), &done, &progress_mutex, _1));
+
+    // every job fills and maps its own component only
+    QImage result = inputTexture;
+    offsetMap_ = COWMatrix<QPoint>(inputTexture.size(), QPoint(0, 0));
+    reliabilityMap_ = COWMatrix<qreal>(inputTexture.size(), 1.0);
+    for (int c=0; c<jobs.size(); ++c) {
+        const ComponentJob& job = jobs[c];
+        // library offsets point into the atlas, not relative to the roi
+        QPoint shift = library_?job.roi.topLeft():QPoint(0, 0);
+        for (int j=0; j<job.roi.height(); ++j)
+            for (int i=0; i<job.roi.width(); ++i) {
+                QPoint p = job.roi.topLeft() + QPoint(i, j);
+                if (labels.get(p) != c)
+                    continue;
+                if (job.holes.test(i, j))
+                    result.setPixel(p, job.result.pixel(i, j));
+                offsetMap_.set(p, job.offsets.get(i, j) - shift);
+                reliabilityMap_.set(p, job.reliabilities.get(i, j));
+            }
     }
+
+    outputTexture_ = result;
+    return outputTexture_;
+}
+
+Resynthesizer::ComponentJob Resynthesizer::componentJob(const BitMask& holes,
+                      const COWMatrix<int>& labels, int component, const QRect& roi) const
+{
+    ComponentJob job;
+    job.roi = roi;
+    job.holes = BitMask(roi.size());
+
+    BitMask others(roi.size());
+    for (int j=0; j<roi.height(); ++j) {
+        int y = roi.top() + j;
+        for (int x=holes.nextSet(y, roi.left()); x<=roi.right(); x=holes.nextSet(y, x+1)) {
+            if (labels.get(x, y) == component)
+                job.holes.set(x - roi.left(), j);
+            else
+                others.set(x - roi.left(), j);
+        }
+    }
+    job.sourceRegion = others.dilated(R).inverted();
+    if (!library_ && !sourceRegion_.isNull())
+        job.sourceRegion &= sourceRegion_.cropped(roi);
+
+    return job;
+}
+
+bool Resynthesizer::hasSourcePatch(const ComponentJob& job) const
+{
+    // the atlas doesn't depend on the crop
+    if (library_)
+        return true;
+
+    // at every level the job will run, the way buildOffsetMap
+    // finds valid centres
+    int lod_max = lodMaxFor(job.holes);
+    for (int level=0; level<=lod_max; ++level) {
+        QSize size = lod_size(job.roi.size(), level);
+        BitMask sources = job.holes.scaled(size).inverted();
+        for (int pass=0; pass<=R; ++pass)
+            sources = sources.shrunk();
+        sources &= job.sourceRegion.scaled(size);
+        if (sources.withoutBorder(R).isEmpty())
+            return false;
+    }
+    return true;
+}
+
+void Resynthesizer::inpaintComponent(const QImage* inputTexture, ComponentJob* jobs, int jobCount,
+                      int* done, QMutex* progressMutex, int index) const
+{
+    ComponentJob& job = jobs[index];
+
+    // same settings, one problem, no shards for something this small
+    Resynthesizer child(*this);
+    child.splitHoles_ = false;
+    child.shardCount_ = 1;
+    child.progress_ = ResynthesizerProgress();
+    // already cut by the parent's region
+    child.sourceRegion_ = job.sourceRegion;
+    if (timeBudget_)
+        child.timeBudget_ = qMax(1, timeBudget_ - clock_.elapsed());
+
+    job.result = child.inpaintHier(inputTexture->copy(job.roi), job.holes);
+    job.offsets = child.offsetMap();
+    job.reliabilities = child.reliabilityMap();
+
+    // one call at a time, so the counts arrive in order
+    if (progress_) {
+        QMutexLocker lock(progressMutex);
+        progress_(++*done, jobCount);
+    }
+}
+
+int Resynthesizer::lodMaxFor(const BitMask& holes) const
+{
+    // the coarsest level is the one where the hole is still about a patch
+    // across: holes converge from there in a few passes, and levels
+    // where the hole is smaller than a patch only cost time
+    int radius = inscribed_radius(holes);
+
+    int lod_max = 0;
+    while (lod_max < lodLimit_ && (radius >> (lod_max+1)) >= R) {
+        QSize size = lod_size(holes.size(), lod_max+1);
+        if (qMin(size.width(), size.height()) < MIN_LOD_SIDE)
+            break;
+        ++lod_max;
+    }
+
+    qDebug() << "hole radius" << radius << "levels" << lod_max+1;
+    return lod_max;
+}
+
+QImage Resynthesizer::inpaintWarm(const QImage& inputTexture,
+                              const QImage& outputMap,
+                              const COWMatrix<QPoint>& previous)
+{
+    return inpaintWarm(inputTexture, BitMask::fromImage(outputMap), previous);
+}
+
+QImage Resynthesizer::inpaintWarm(const QImage& inputTexture,
+                              const BitMask& holes,
+                              const COWMatrix<QPoint>& previous)
+{
+    if (previous.size() != inputTexture.size())
+        return inpaintHier(inputTexture, holes);
+
+    lodLevel_ = 0;
+    warmHint_ = true;
+    clock_.start();
+    levelDeadline_ = timeBudget_?timeBudget_:-1;
+    buildOffsetMap(inputTexture, holes, previous);
+    levelDeadline_ = -1;
+    warmHint_ = false;
+
+    if (progress_)
+        progress_(1, 1);
+
     return outputTexture_;
 }
 
 COWMatrix<QPoint> Resynthesizer::buildOffsetMap(const QImage& inputTexture,
-                      const QImage& outputMap,
+                      const BitMask& holes,
                       const COWMatrix<QPoint>& hint)
 {
     TRACE_ME
 
-    realMap_ = QImage(outputMap.size(), QImage::Format_Mono);
-    realMap_.fill(1);
-    for (int j=0; j<outputMap.height(); ++j)
-        for (int i=0; i<outputMap.width(); ++i)
-            if (outputMap.pixel(i, j))
-                realMap_.setPixel(i, j, 0);
+    // known pixels whose whole patch is known as well
+    realMap_ = holes.inverted();
     for (int pass=0; pass<=R; ++pass)
-        realMap_ = grow_selection(realMap_);
-
-    SimilarityMapper sm;
+        realMap_ = realMap_.shrunk();
 
     inputTexture_ = &inputTexture;
-    outputTexture_ = inputTexture;
+    // the level's own buffer: votes are written into it in place, the
+    // mapper only reads views of it, so it is copied here and nowhere else
+    outputTexture_ = inputTexture.copy();
+
+    sourceTexture_ = library_?&library_->atlas(lodLevel_):&inputTexture;
+    BitMask sourceMask = library_?library_->atlasMask(lodLevel_):realMap_;
+    if (!library_ && !sourceRegion_.isNull()) {
+        // random offsets are drawn from valid centres, there has to be one
+        BitMask restricted = sourceMask;
+        restricted &= sourceRegion_.scaled(inputTexture.size());
+        if (restricted.withoutBorder(R).isEmpty())
+            qDebug() << "source region holds no patch at level" << lodLevel_ << ", ignored";
+        else
+            sourceMask = restricted;
+    }
+
+    if (sourceMask.withoutBorder(R).isEmpty()) {
+        qDebug() << "no source patches at level" << lodLevel_ << ", holes left unfilled";
+        offsetMap_ = hint.isNull()?COWMatrix<QPoint>(inputTexture.size(), QPoint(0, 0)):hint;
+        reliabilityMap_ = COWMatrix<qreal>(inputTexture.size(), 1.0);
+        for (int j=0; j<realMap_.height(); ++j)
+            for (int i=realMap_.nextClear(j, 0); i<realMap_.width(); i=realMap_.nextClear(j, i+1))
+                reliabilityMap_.set(i, j, 0.0);
+        return offsetMap_;
+    }
 
-    if (hint.isNull()) {
+    // the displacement limit shrinks with the level, rounding up
+    int max_displacement = -1;
+    if (!library_ && maxDisplacement_ >= 0)
+        max_displacement = (maxDisplacement_ + (1 << lodLevel_) - 1) >> lodLevel_;
+
+    // what the mapper starts from
+    COWMatrix<QPoint> start = hint;
+
+    NnField cached;
+    bool warm = !cacheKey_.isEmpty() &&
+        fieldCache_->load(cacheKey_, lodLevel_, &cached) &&
+        cached.offsets.size() == inputTexture.size();
+
+    if (warm) {
+        qDebug() << "warm start from cached field";
+        offsetMap_ = cached.offsets;
+    } else if (hint.isNull()) {
         offsetMap_ = COWMatrix<QPoint>(inputTexture.size());
         // generate initial offsetmap
         offsetMap_.fill(QPoint(0, 0));
 
-        RandomOffsetGenerator rog(realMap_, R);
-        for (int j=0; j<outputMap.height(); ++j)
-            for (int i=0; i<outputMap.width(); ++i)
-                if (!realMap_.pixelIndex(i, j))
+        RandomOffsetGenerator rog(sourceMask, R);
+        for (int j=0; j<holes.height(); ++j)
+            for (int i=0; i<holes.width(); ++i)
+                if (!realMap_.test(i, j))
                     offsetMap_.set(i, j, rog(i, j));
+
+        if (RInitOnionPeel == initMode_) {
+            offsetMap_ = onionPeelField(holes, sourceMask, max_displacement);
+            start = offsetMap_;
+        }
     } else {
         offsetMap_ = hint;
     }
 
     // fill offsetmap with random offsets for unknows points
     confidenceMap_ = QVector<double>(realMap_.width()*realMap_.height(), 1.0);
-    for (int j=0; j<outputMap.height(); ++j)
-        for (int i=0; i<outputMap.width(); ++i)
-            if (!realMap_.pixelIndex(i, j))
-                confidenceMap_[j*outputMap.width()+i] = 1e-10;
+    for (int j=0; j<holes.height(); ++j)
+        for (int i=0; i<holes.width(); ++i)
+            if (!realMap_.test(i, j))
+                confidenceMap_[j*holes.width()+i] = 1e-10;
 
+    knnField_ = KnnField();
     mergePatches(false);
 
-    sm.init(inputTexture, outputTexture_, realMap_, realMap_);
+    // out of time, the coarser level's field is the best we have
+    if (outOfTime() && !hint.isNull()) {
+        qDebug() << "out of time, level" << lodLevel_ << "not refined";
+        return offsetMap_;
+    }
+
+    if (shardCount_ > 1) {
+        ShardedSimilarityMapper sm(shardCount_, shardWorker_);
+        sm.setEngine(engine_);
+        sm.setWeightMode(weights_);
+        sm.setSourceLayout(layout_);
+        sm.setMaxDisplacement(max_displacement);
+        if (sm.init(*sourceTexture_, outputTexture_, sourceMask, realMap_)) {
+            runMapper(&sm, warm?cached:NnField(), start);
+            if (!sm.failed())
+                return offsetMap_;
+
+            qDebug() << "shard worker lost, mapping level" << lodLevel_ << "in process";
+            if (!warm)
+                start = offsetMap_;
+        }
+    }
+
+    SimilarityMapper sm;
+    sm.setThreadPool(pool_, chunkCount_);
+    sm.setEngine(engine_);
+    sm.setWeightMode(weights_);
+    sm.setSourceLayout(layout_);
+    sm.setNeighbourCount(neighbourCount_);
+    sm.setMaxDisplacement(max_displacement);
+    sm.init(*sourceTexture_, outputTexture_, sourceMask, realMap_);
+    runMapper(&sm, warm?cached:NnField(), start);
+
+    return offsetMap_;
+}
+
+COWMatrix<QPoint> Resynthesizer::onionPeelField(const BitMask& holes,
+                      const BitMask& sourceMask, int maxDisplacement) const
+{
+    TRACE_ME
+
+    COWMatrix<QPoint> field = offsetMap_;
+    const QImage& source = *sourceTexture_;
+    BitMask sources = sourceMask.withoutBorder(R);
+    RandomOffsetGenerator rog(sourceMask, R);
+    int init_range = qMax(source.width(), source.height());
+
+    // filled holes are written here, so later rings match against them
+    QImage image = inputTexture_->copy();
+    BitMask known = holes.inverted();
+    // pixels without an offset yet, the first ring is those with a
+    // 4-neighbour outside, the edges of the image don't count; every
+    // later one those of the remaining 4-neighbours of the ring before
+    BitMask remaining = realMap_.inverted();
+    BitMask inner = remaining.shrunk();
+    // pixels put in a ring already
+    BitMask queued(remaining.size());
+    QPolygon ring;
+    for (int j=0; j<remaining.height(); ++j)
+        for (int i=remaining.nextSet(j, 0); i<remaining.width(); i=remaining.nextSet(j, i+1))
+            if (!inner.test(i, j)) {
+                ring << QPoint(i, j);
+                queued.set(i, j);
+            }
+
+    int ring_count = 0;
+    while (!ring.isEmpty()) {
+        if (outOfTime()) {
+            qDebug() << "out of time, onion peel stopped";
+            break;
+        }
+        ++ring_count;
+
+        foreach (QPoint p, ring) {
+            QPoint best_offset = field.get(p);
+            int best_score = INT_MAX;
+
+            QPolygon candidates;
+            for (int dy=-1; dy<=1; ++dy)
+                for (int dx=-1; dx<=1; ++dx) {
+                    QPoint q = p + QPoint(dx, dy);
+                    // neighbours peeled before, their sources continued
+                    if (remaining.contains(q) && !remaining.test(q) && !realMap_.test(q))
+                        candidates << field.get(q);
+                }
+            for (int n=0; n<ONION_RANDOM_CANDIDATES; ++n)
+                candidates << rog(p);
+
+            foreach (QPoint o, candidates) {
+                if (!is_valid_offset(sources, p, o, maxDisplacement))
+                    continue;
+                int score = known_patch_distance(image, known, p, source, p+o);
+                if (score < best_score) {
+                    best_score = score;
+                    best_offset = o;
+                }
+            }
+
+            // and a random search around the best of them
+            if (best_score != INT_MAX)
+                for (int range=init_range; range>0; range/=2) {
+                    QPoint o(best_offset);
+                    o.rx() += qrand()%(2*range) - range;
+                    o.ry() += qrand()%(2*range) - range;
+                    if (!is_valid_offset(sources, p, o, maxDisplacement))
+                        continue;
+                    int score = known_patch_distance(image, known, p, source, p+o);
+                    if (score < best_score) {
+                        best_score = score;
+                        best_offset = o;
+                    }
+                }
+
+            field.set(p, best_offset);
+            remaining.set(p, false);
+            if (holes.test(p) && best_score != INT_MAX) {
+                image.setPixel(p, source.pixel(p + best_offset));
+                known.set(p);
+            }
+        }
+
+        QPolygon next;
+        foreach (QPoint p, ring) {
+            const QPoint neighbours[] = {QPoint(-1, 0), QPoint(1, 0), QPoint(0, -1), QPoint(0, 1)};
+            for (int n=0; n<4; ++n) {
+                QPoint q = p + neighbours[n];
+                if (remaining.contains(q) && remaining.test(q) && !queued.test(q)) {
+                    queued.set(q);
+                    next << q;
+                }
+            }
+        }
+        ring = next;
+    }
+
+    qDebug() << "onion peel init," << ring_count << "rings";
+    return field;
+}
+
+template <typename Mapper>
+void Resynthesizer::runMapper(Mapper* sm, const NnField& cached, const COWMatrix<QPoint>& hint)
+{
+    bool warm = !cached.isNull();
+
+    int pass_count = passCount_;
+    sm->setPassCount(mapperPassCount_);
+    if (warm || (warmHint_ && !hint.isNull())) {
+        sm->seed(warm?cached.offsets:hint);
+        sm->setPassCount(WARM_MAPPER_PASS_COUNT);
+        pass_count = WARM_PASS_COUNT;
+    } else if (!hint.isNull()) {
+        // the upscaled coarser level beats random offsets
+        sm->seed(hint);
+    }
+    sm->setDeadline(clock_, levelDeadline_);
 
     double prev_mean_score = 4.f*256*256;
     int prev_max_score = INT_MAX;
-    for (int pass=0; pass<PASS_COUNT; ++pass) {
-        // update offsetMap_
-        offsetMap_ = sm.iterate(outputTexture_);
-
-        reliabilityMap_ = sm.reliabilityMap();
+    bool cut_short = false;
+    QTime iteration_clock;
+    for (int pass=0; pass<pass_count; ++pass) {
+        // the first iteration always runs, later ones only when
+        // they are likely to finish in time
+        if (pass > 0 && levelDeadline_ >= 0 &&
+            clock_.elapsed() + iteration_clock.elapsed() > levelDeadline_) {
+            cut_short = true;
+            break;
+        }
+        iteration_clock.start();
+        DetachCheck detach_check(outputTexture_);
+
+        // update offsetMap_; a sharded mapper that lost a worker returns
+        // nothing, the caller goes on from the last field
+        COWMatrix<QPoint> offsets = sm->iterate(outputTexture_);
+        if (offsets.isNull())
+            return;
+        offsetMap_ = offsets;
+
+        reliabilityMap_ = sm->reliabilityMap();
+        knnField_ = sm->knnField();
         mergePatches(true);
 
-        double mean_score = sm.meanScore();
-        int max_score = sm.maxScore();
-        if (mean_score > prev_mean_score*0.995 && mean_score <= prev_mean_score &&
-            max_score > prev_max_score*0.995 && max_score <= prev_max_score) {
+        // nothing may keep a copy of the buffer votes are written to
+        detach_check.check(outputTexture_);
+
+        double mean_score = sm->meanScore();
+        int max_score = sm->maxScore();
+        if (mean_score > prev_mean_score*convergence_ && mean_score <= prev_mean_score &&
+            max_score > prev_max_score*convergence_ && max_score <= prev_max_score) {
             // local minimum sort of found
             break;
         }
@@ -132,7 +673,9 @@ COWMatrix<QPoint> Resynthesizer::buildOffsetMap(const QImage& inputTexture,
         prev_max_score = max_score;
     }
 
-    return offsetMap_;
+    // a field cut short would make later warm starts worse
+    if (!cacheKey_.isEmpty() && !cut_short && !outOfTime())
+        fieldCache_->store(cacheKey_, lodLevel_, sm->field());
 }
 
 void Resynthesizer::mergePatches(bool weighted)
@@ -143,9 +686,10 @@ void Resynthesizer::mergePatches(bool weighted)
 
     QVector<qreal> new_confidence_map(confidenceMap_);
 
-    for (int j=0; j<height; ++j)
+    for (int j=0; j<height; ++j) {
+        QRgb* out = reinterpret_cast<QRgb*>(outputTexture_.scanLine(j));
         for (int i=0; i<width; ++i)
-            if (!realMap_.pixelIndex(i, j)) {
+            if (!realMap_.test(i, j)) {
                 QPoint p(i, j);
                 qreal r = 0.0, g = 0.0, b = 0.0;
                 qreal new_confidence = 0.0;
@@ -158,11 +702,36 @@ void Resynthesizer::mergePatches(bool weighted)
                         if (!bounds.contains(near_p))
                             continue;
 
-                        QPoint opinion_point = p + offsetMap_.get(near_p);
+                        int idx = (near_p).y()*width + (near_p).x();
 
-                        QColor c(inputTexture_->pixel(opinion_point));
+                        if (weighted && !knnField_.isNull() && !realMap_.test(near_p)) {
+                            // every one of the k matches of near_p votes
+                            const QPoint* offsets = knnField_.offsets(near_p);
+                            const int* scores = knnField_.scores(near_p);
+                            for (int n=0; n<knnField_.k(); ++n) {
+                                if (scores[n] == INT_MAX)
+                                    continue;
+
+                                QColor c(clamped_pixel(*sourceTexture_, p + offsets[n]));
+                                qreal weight = SimilarityMapper::scoreToReliability(scores[n])*
+                                    confidenceMap_[idx];
+
+                                new_confidence += confidenceMap_[idx]*weight;
+
+                                r += c.red()*weight;
+                                g += c.green()*weight;
+                                b += c.blue()*weight;
+
+                                weight_sum += weight;
+                            }
+                            continue;
+                        }
+
+                        // known patches vote with themselves
+                        QColor c(realMap_.test(near_p)
+                                    ?inputTexture_->pixel(p)
+                                    :clamped_pixel(*sourceTexture_, p + offsetMap_.get(near_p)));
 
-                        int idx = (near_p).y()*width + (near_p).x();
                         qreal weight = (weighted)
                                             ?(reliabilityMap_.get(near_p)*confidenceMap_[idx])
                                             :1.0;
@@ -185,9 +754,10 @@ void Resynthesizer::mergePatches(bool weighted)
                 g /= weight_sum;
                 b /= weight_sum;
 
-                outputTexture_.setPixel(p, QColor(r, g, b).rgb());
+                out[i] = QColor(r, g, b).rgb();
                 new_confidence_map[p.y()*width + p.x()] = new_confidence/weight_sum;
             }
+    }
     confidenceMap_ = new_confidence_map;
 }
 
@@ -3,36 +3,222 @@
 
 #include <QImage>
 #include <QPoint>
+#include <QRect>
+#include <QString>
+#include <QTime>
 #include <QVector>
+#include <boost/function.hpp>
 
 #include "cowmatrix.h"
+#include "similaritymapper.h"
+
+class NnfCache;
+class QMutex;
+class QThreadPool;
+class SourceLibrary;
+
+enum ResynthesizerPreset
+{
+    // shallower pyramid, fewer passes, looser convergence test
+    RPresetFast,
+    RPresetBalanced,
+    // more passes, runs until nearly nothing changes
+    RPresetBest
+};
+
+enum ResynthesizerInit
+{
+    // independent random offsets for every unknown pixel
+    RInitRandom,
+    // the hole is filled ring by ring from its boundary inward, every
+    // pixel matched against known and already filled neighbours
+    RInitOnionPeel
+};
+
+// levels done so far and the level count, called from the thread
+// running inpaintHier or inpaintWarm
+typedef boost::function<void (int, int)> ResynthesizerProgress;
 
 class Resynthesizer
 {
 
 public:
+    Resynthesizer();
+
+    // PatchMatch passes are split into chunkCount jobs on pool
+    void setThreadPool(QThreadPool* pool, int chunkCount);
+
+    void setSearchEngine(SimilarityMapperEngine engine) { engine_ = engine; }
+
+    void setWeightMode(SimilarityMapperWeights weights) { weights_ = weights; }
+
+    void setSourceLayout(SimilarityMapperLayout layout) { layout_ = layout; }
+
+    // pass counts, convergence test and the deepest pyramid allowed,
+    // balanced by default; the depth itself follows the hole size
+    void setPreset(ResynthesizerPreset preset);
+
+    // how the coarsest level's field starts, random by default
+    void setInitMode(ResynthesizerInit mode) { initMode_ = mode; }
+
+    // inpaintHier and inpaintWarm stop refining once msec have passed and
+    // return the best result so far; the budget is split between levels
+    // by their size, levels started too late only vote with the upscaled
+    // field. 0 means no limit
+    void setTimeBudget(int msec) { timeBudget_ = msec; }
+
+    // inpaintHier fills holes further apart than a patch as separate
+    // problems, concurrently on the thread pool: each gets the area
+    // around it as source and stops when it converges itself
+    void setSplitHoles(bool split) { splitHoles_ = split; }
+
+    // called after every finished level; with split holes after every
+    // finished hole instead, from the pool threads, one call at a time
+    void setProgressCallback(const ResynthesizerProgress& progress) { progress_ = progress; }
+
+    // patches vote with their k best matches instead of one
+    void setNeighbourCount(int k) { neighbourCount_ = k; }
+
+    // fill holes from a prepared library instead of the image itself,
+    // offsets then point into the library atlas of each level
+    void setSourceLibrary(const SourceLibrary* library) { library_ = library; }
+
+    // split PatchMatch of large levels over worker processes,
+    // 1 keeps it in this process; workers are workerProgram run with
+    // --shard-worker (see ShardedSimilarityMapper), by default the running
+    // executable, so hosts other than unseeit have to name one
+    void setShardCount(int count, const QString& workerProgram = QString()) {
+        shardCount_ = count;
+        shardWorker_ = workerProgram;
+    }
+
+    // warm start inpaintHier levels from fields stored by earlier runs
+    // on the same inputs, and store the new ones
+    void setFieldCache(const NnfCache* cache) { fieldCache_ = cache; }
+
+    // spatial priors, in full resolution pixels: patches are only taken
+    // from set pixels of region, and from at most maxDisplacement pixels
+    // away in either direction (negative for no limit); both are ignored
+    // with a source library
+    void setSourceRegion(const BitMask& region) { sourceRegion_ = region; }
+    void setMaxDisplacement(int pixels) { maxDisplacement_ = pixels; }
+
+    // holes are set pixels
     COWMatrix<QPoint> buildOffsetMap(const QImage& inputTexture,
-                          const QImage& outputMap,
+                          const BitMask& holes,
                           const COWMatrix<QPoint>& hint);
+
+    // outputMap - non-zero pixels are holes
     QImage inpaintHier(const QImage& inputTexture, const QImage& outputMap);
+    QImage inpaintHier(const QImage& inputTexture, const BitMask& holes);
+
+    // full resolution only, starting from the offsets of a similar
+    // earlier image (e.g. the previous video frame), null previous
+    // falls back to inpaintHier
+    QImage inpaintWarm(const QImage& inputTexture, const QImage& outputMap,
+                       const COWMatrix<QPoint>& previous);
+    QImage inpaintWarm(const QImage& inputTexture, const BitMask& holes,
+                       const COWMatrix<QPoint>& previous);
 
     COWMatrix<QPoint> offsetMap() { return offsetMap_; }
     COWMatrix<qreal> reliabilityMap() { return reliabilityMap_; }
 
 private:
+    // one hole of a split mask, in coordinates of its roi
+    struct ComponentJob
+    {
+        QRect roi;
+        BitMask holes;
+        // excludes patches over the other holes in roi,
+        // and what the parent's source region excludes
+        BitMask sourceRegion;
+
+        QImage result;
+        COWMatrix<QPoint> offsets;
+        COWMatrix<qreal> reliabilities;
+    };
+
+    QImage inpaintComponents(const QImage& inputTexture, const BitMask& holes,
+                          const COWMatrix<int>& labels, const QVector<QRect>& components);
+    ComponentJob componentJob(const BitMask& holes, const COWMatrix<int>& labels,
+                          int component, const QRect& roi) const;
+    // the job's crop has patches to copy at the levels it will run
+    bool hasSourcePatch(const ComponentJob& job) const;
+    // done counts finished jobs for progress_, under progressMutex
+    void inpaintComponent(const QImage* inputTexture, ComponentJob* jobs, int jobCount,
+                          int* done, QMutex* progressMutex, int index) const;
+
     void mergePatches(bool weighted);
 
+    // coarsest pyramid level for the holes
+    int lodMaxFor(const BitMask& holes) const;
+
+    // offsets for the pixels outside realMap_, see RInitOnionPeel;
+    // pixels it can't match, or doesn't reach before the level's
+    // deadline, keep their offset from offsetMap_
+    COWMatrix<QPoint> onionPeelField(const BitMask& holes,
+                          const BitMask& sourceMask, int maxDisplacement) const;
+
+    bool outOfTime() const { return levelDeadline_ >= 0 && clock_.elapsed() >= levelDeadline_; }
+
+    // EM loop, Mapper is SimilarityMapper or ShardedSimilarityMapper
+    // already initialized with the level's inputs
+    template <typename Mapper>
+    void runMapper(Mapper* sm, const NnField& cached, const COWMatrix<QPoint>& hint);
+
     // TODO: stop using QVector and QImage as matrices ffs
     //       oh wow, there's some progress on that
 
     QVector<qreal> confidenceMap_;
     const QImage* inputTexture_;
+    // where votes for unknown pixels come from, inputTexture_ or an atlas
+    const QImage* sourceTexture_;
     QImage outputTexture_;
 
     COWMatrix<QPoint> offsetMap_;
     COWMatrix<qreal> reliabilityMap_;
+    KnnField knnField_;
+
+    BitMask realMap_;
+
+    QThreadPool* pool_;
+    int chunkCount_;
+
+    SimilarityMapperEngine engine_;
+    SimilarityMapperWeights weights_;
+    SimilarityMapperLayout layout_;
+    int neighbourCount_;
+    int shardCount_;
+    QString shardWorker_;
+    bool splitHoles_;
+    ResynthesizerInit initMode_;
+
+    BitMask sourceRegion_;
+    int maxDisplacement_;
+
+    // from the preset
+    int lodLimit_;
+    int passCount_;
+    int mapperPassCount_;
+    // EM stops once an iteration improves scores by less than this
+    double convergence_;
+
+    int timeBudget_;
+    ResynthesizerProgress progress_;
+    // runs from the start of inpaintHier or inpaintWarm,
+    // levelDeadline_ is in its milliseconds, -1 outside of them
+    QTime clock_;
+    int levelDeadline_;
+
+    const SourceLibrary* library_;
+    int lodLevel_;
+
+    // hint is a converged field of a similar image, not an upscaled guess
+    bool warmHint_;
 
-    QImage realMap_;
+    const NnfCache* fieldCache_;
+    // empty outside of inpaintHier
+    QByteArray cacheKey_;
 };
 
 #endif
@@ -0,0 +1,114 @@
+#include "sequenceinpainter.h"
+
+#include <QDir>
+#include <QFuture>
+#include <QImage>
+#include <QStringList>
+#include <QThreadPool>
+#include <QtConcurrentRun>
+
+#include "consts.h"
+#include "resynthesizer.h"
+#include "utils.h"
+
+namespace {
+
+struct Frame
+{
+    QString name;
+    QImage image;
+    QImage overlay;
+};
+
+Frame loadFrame(QString name, QString framePath, QString maskPath)
+{
+    Frame frame;
+    frame.name = name;
+
+    QImage image(framePath);
+    QImage mask(maskPath);
+    if (image.isNull() || mask.isNull() || image.size() != mask.size()) {
+        qDebug() << "can't load" << framePath << maskPath;
+        return frame;
+    }
+
+    frame.image = image.convertToFormat(QImage::Format_ARGB32);
+    frame.overlay = mask_to_overlay(mask);
+    return frame;
+}
+
+bool saveFrame(QImage result, QString path)
+{
+    bool ok = result.save(path);
+    if (!ok)
+        qDebug() << "can't save" << path;
+    return ok;
+}
+
+};
+
+SequenceInpainter::SequenceInpainter():
+    pool_(QThreadPool::globalInstance()), chunkCount_(JOB_CHUNK_COUNT)
+{
+}
+
+void SequenceInpainter::setThreadPool(QThreadPool* pool, int chunkCount)
+{
+    pool_ = pool;
+    chunkCount_ = chunkCount;
+}
+
+int SequenceInpainter::run(const QString& frameDir, const QString& maskDir, const QString& outputDir)
+{
+    TRACE_ME
+
+    QDir frames(frameDir);
+    QDir masks(maskDir);
+    QDir output(outputDir);
+    output.mkpath(".");
+
+    QStringList names = frames.entryList(QDir::Files, QDir::Name);
+    if (names.isEmpty())
+        return 0;
+
+    int failed = 0;
+    COWMatrix<QPoint> previous;
+
+    QFuture<Frame> next = QtConcurrent::run(loadFrame, names[0],
+            frames.filePath(names[0]), masks.filePath(names[0]));
+    QFuture<bool> saved;
+    bool saving = false;
+
+    for (int f=0; f<names.size(); ++f) {
+        Frame frame = next.result();
+
+        // decode ahead while this frame is computed
+        if (f+1 < names.size())
+            next = QtConcurrent::run(loadFrame, names[f+1],
+                    frames.filePath(names[f+1]), masks.filePath(names[f+1]));
+
+        if (frame.image.isNull()) {
+            ++failed;
+            // the next frame can't continue from this one
+            previous = COWMatrix<QPoint>();
+            continue;
+        }
+
+        ScopeTracer frame_tracer(frame.name);
+
+        Resynthesizer r;
+        r.setThreadPool(pool_, chunkCount_);
+        QImage result = r.inpaintWarm(frame.image, frame.overlay, previous);
+        previous = r.offsetMap();
+
+        if (saving && !saved.result())
+            ++failed;
+        saved = QtConcurrent::run(saveFrame, result, output.filePath(frame.name));
+        saving = true;
+    }
+
+    if (saving && !saved.result())
+        ++failed;
+
+    return failed;
+}
@@ -0,0 +1,32 @@
+#ifndef UNSEEIT_SEQUENCEINPAINTER_H
+#define UNSEEIT_SEQUENCEINPAINTER_H
+
+#include <QString>
+
+class QThreadPool;
+
+// Object removal on a sequence of video frames.
+//
+// The first frame is solved from scratch, every next one starts from the
+// offsets of the frame before it and only runs a few passes at full
+// resolution. Decoding of the next frame and encoding of the previous one
+// overlap with compute of the current frame.
+class SequenceInpainter
+{
+public:
+    SequenceInpainter();
+
+    void setThreadPool(QThreadPool* pool, int chunkCount);
+
+    // frames are processed in file name order, the mask of every frame
+    // has the same file name in maskDir (light pixels are holes),
+    // results go to outputDir under the same names;
+    // returns the number of frames that failed
+    int run(const QString& frameDir, const QString& maskDir, const QString& outputDir);
+
+private:
+    QThreadPool* pool_;
+    int chunkCount_;
+};
+
+#endif
@@ -0,0 +1,586 @@
+#include "shardedmapper.h"
+
+#include <climits>
+#include <iostream>
+
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDebug>
+#include <QFile>
+#include <QProcess>
+#include <QStringList>
+#include <QThread>
+#include <QThreadPool>
+
+#include "consts.h"
+#include "utils.h"
+
+const int R = 4;
+
+namespace {
+
+// rows of a neighbouring band a shard keeps: R for the patches
+// of its edge rows and one more for propagation
+const int APRON = R+1;
+// thinner bands are not worth a process
+const int MIN_SHARD_ROWS = 64;
+
+// how long the host waits for a worker before giving up on it: without
+// a deadline long enough for a pass over any band, with one that much
+// past it, since the deadline is only checked between passes
+const int WORKER_TIMEOUT_MSEC = 5*60*1000;
+const int WORKER_GRACE_MSEC = 5000;
+
+enum Command
+{
+    // tile and source placement, settings, src, srcMask, dst and dstMask
+    // of the tile
+    CommandInit = 'I',
+    // offsets of the tile
+    CommandSeed = 'S',
+    // pass count, dst of the tile; replies the number of passes
+    CommandBegin = 'B',
+    // pass number; replies the top and bottom edge rows of the band
+    CommandPass = 'P',
+    // top and bottom aprons
+    CommandHalo = 'H',
+    // replies the field of the band
+    CommandEnd = 'E',
+    CommandQuit = 'Q'
+};
+
+// msec - how long to wait for more data, -1 for ever
+bool read_exact(QIODevice* device, char* data, qint64 size, int msec)
+{
+    while (size > 0) {
+        qint64 n = device->read(data, size);
+        if (n < 0)
+            return false;
+        if (n == 0 && !device->waitForReadyRead(msec))
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// messages are a quint32 size followed by the payload
+bool read_message(QIODevice* device, QByteArray* message, int msec = -1)
+{
+    quint32 size;
+    if (!read_exact(device, reinterpret_cast<char*>(&size), sizeof(size), msec))
+        return false;
+    message->resize(size);
+    return read_exact(device, message->data(), size, msec);
+}
+
+bool write_message(QIODevice* device, const QByteArray& message)
+{
+    quint32 size = message.size();
+    return device->write(reinterpret_cast<const char*>(&size), sizeof(size)) == sizeof(size) &&
+        device->write(message) == message.size();
+}
+
+// both ends are the same executable, so images and matrices
+// go over as raw memory
+
+void write_image(QDataStream& stream, const QImage& image)
+{
+    stream << (qint32)image.width() << (qint32)image.height() << (qint32)image.format();
+    if (image.isNull())
+        return;
+    stream << image.colorTable();
+    stream.writeRawData(reinterpret_cast<const char*>(image.bits()), image.byteCount());
+}
+
+QImage read_image(QDataStream& stream)
+{
+    qint32 width, height, format;
+    stream >> width >> height >> format;
+    if (width <= 0 || height <= 0)
+        return QImage();
+
+    QVector<QRgb> colors;
+    stream >> colors;
+    QImage image(width, height, QImage::Format(format));
+    image.setColorTable(colors);
+    stream.readRawData(reinterpret_cast<char*>(image.bits()), image.byteCount());
+    return image;
+}
+
+void write_mask(QDataStream& stream, const BitMask& mask)
+{
+    stream << (qint32)mask.width() << (qint32)mask.height();
+    if (!mask.isNull())
+        stream.writeRawData(reinterpret_cast<const char*>(mask.row(0)),
+            mask.height()*mask.wordsPerRow()*sizeof(quint32));
+}
+
+BitMask read_mask(QDataStream& stream)
+{
+    qint32 width, height;
+    stream >> width >> height;
+    BitMask mask(qMax(0, width), qMax(0, height));
+    if (!mask.isNull())
+        stream.readRawData(reinterpret_cast<char*>(mask.row(0)),
+            mask.height()*mask.wordsPerRow()*sizeof(quint32));
+    return mask;
+}
+
+template <typename T>
+void write_matrix(QDataStream& stream, const COWMatrix<T>& matrix)
+{
+    stream << (qint32)matrix.width() << (qint32)matrix.height();
+    if (!matrix.isNull())
+        stream.writeRawData(reinterpret_cast<const char*>(matrix.ptrAt(0, 0)),
+            matrix.width()*matrix.height()*sizeof(T));
+}
+
+template <typename T>
+COWMatrix<T> read_matrix(QDataStream& stream)
+{
+    qint32 width, height;
+    stream >> width >> height;
+    COWMatrix<T> matrix(qMax(0, width), qMax(0, height));
+    if (!matrix.isNull())
+        stream.readRawData(reinterpret_cast<char*>(matrix.ptrAt(0, 0)),
+            matrix.width()*matrix.height()*sizeof(T));
+    return matrix;
+}
+
+void write_field(QDataStream& stream, const NnField& field)
+{
+    write_matrix(stream, field.offsets);
+    write_matrix(stream, field.scores);
+    write_matrix(stream, field.reliabilities);
+}
+
+NnField read_field(QDataStream& stream)
+{
+    NnField field;
+    field.offsets = read_matrix<QPoint>(stream);
+    field.scores = read_matrix<int>(stream);
+    field.reliabilities = read_matrix<qreal>(stream);
+    return field;
+}
+
+// offsets of a tile starting at row tile_top into a source starting at
+// row src_top are off by tile_top - src_top rows from the full image ones:
+// src = p + offset in both
+void shift_offsets(COWMatrix<QPoint>* offsets, int dy)
+{
+    for (int j=0; j<offsets->height(); ++j)
+        for (int i=0; i<offsets->width(); ++i)
+            offsets->set(i, j, offsets->get(i, j) + QPoint(0, dy));
+}
+
+};
+
+ShardedSimilarityMapper::ShardedSimilarityMapper(int shardCount, const QString& workerProgram):
+    shardCount_(shardCount),
+    workerProgram_(workerProgram.isEmpty()?QCoreApplication::applicationFilePath():workerProgram),
+    failed_(false),
+    engine_(SMEnginePatchMatch), weights_(SMWeightsDouble), layout_(SMLayoutRowMajor), maxDisplacement_(-1), passCount_(0), deadline_(-1),
+    meanScore_(0), maxScore_(0)
+{
+}
+
+ShardedSimilarityMapper::~ShardedSimilarityMapper()
+{
+    stop();
+}
+
+void ShardedSimilarityMapper::stop()
+{
+    QByteArray quit;
+    QDataStream(&quit, QIODevice::WriteOnly) << (quint8)CommandQuit;
+
+    foreach(const Shard& shard, shards_) {
+        if (shard.process->state() == QProcess::Running) {
+            write_message(shard.process, quit);
+            shard.process->closeWriteChannel();
+            if (!shard.process->waitForFinished())
+                shard.process->kill();
+        }
+        delete shard.process;
+    }
+    shards_.clear();
+}
+
+bool ShardedSimilarityMapper::init(const QImage& src, const QImage& dst,
+    const BitMask& srcMask, const BitMask& dstMask)
+{
+    TRACE_ME
+
+    stop();
+    failed_ = false;
+
+    int height = dst.height();
+    int count = qMin(shardCount_, height/MIN_SHARD_ROWS);
+    if (count < 2)
+        return false;
+
+    dstMask_ = dstMask;
+    field_ = NnField();
+
+    // cores are split between the workers
+    int threads = qMax(1, QThread::idealThreadCount()/count);
+
+    for (int n=0; n<count; ++n) {
+        Shard shard;
+        shard.begin = n*height/count;
+        shard.end = (n+1)*height/count;
+        shard.tileBegin = qMax(0, shard.begin - APRON);
+        shard.tileEnd = qMin(height, shard.end + APRON);
+        // the reachable source centres are at most maxDisplacement_ rows
+        // from the tile, their patches R more
+        shard.srcBegin = 0;
+        shard.srcEnd = src.height();
+        if (maxDisplacement_ >= 0) {
+            shard.srcBegin = qBound(0, shard.tileBegin - maxDisplacement_ - R, src.height());
+            shard.srcEnd = qBound(shard.srcBegin, shard.tileEnd + maxDisplacement_ + R, src.height());
+        }
+        shard.process = new QProcess;
+        shards_ << shard;
+
+        shard.process->start(workerProgram_, QStringList() << "--shard-worker");
+        if (!shard.process->waitForStarted()) {
+            qDebug() << "can't start shard worker:" << shard.process->errorString();
+            stop();
+            return false;
+        }
+    }
+
+    for (int n=0; n<shards_.size(); ++n) {
+        const Shard& shard = shards_[n];
+        int tile_height = shard.tileEnd - shard.tileBegin;
+
+        QByteArray message;
+        QDataStream stream(&message, QIODevice::WriteOnly);
+        stream << (quint8)CommandInit << (qint32)shard.tileBegin << (qint32)shard.srcBegin
+            << (qint32)(shard.begin - shard.tileBegin) << (qint32)(shard.end - shard.tileBegin)
+            << (qint32)engine_ << (qint32)weights_ << (qint32)layout_ << (qint32)threads
+            << (qint32)maxDisplacement_;
+        write_image(stream, src.copy(0, shard.srcBegin, src.width(), shard.srcEnd - shard.srcBegin));
+        write_mask(stream, srcMask.rows(shard.srcBegin, shard.srcEnd));
+        write_image(stream, dst.copy(0, shard.tileBegin, dst.width(), tile_height));
+        write_mask(stream, dstMask.rows(shard.tileBegin, shard.tileBegin + tile_height));
+        if (!send(n, message))
+            return false;
+    }
+
+    qDebug() << shards_.size() << "shards," << threads << "threads each";
+    return true;
+}
+
+void ShardedSimilarityMapper::seed(const COWMatrix<QPoint>& offsets)
+{
+    for (int n=0; n<shards_.size(); ++n) {
+        const Shard& shard = shards_[n];
+
+        COWMatrix<QPoint> tile(offsets.width(), shard.tileEnd - shard.tileBegin);
+        for (int j=0; j<tile.height(); ++j)
+            for (int i=0; i<tile.width(); ++i)
+                tile.set(i, j, offsets.get(i, shard.tileBegin + j));
+        shift_offsets(&tile, shard.tileBegin - shard.srcBegin);
+
+        QByteArray message;
+        QDataStream stream(&message, QIODevice::WriteOnly);
+        stream << (quint8)CommandSeed;
+        write_matrix(stream, tile);
+        if (!send(n, message))
+            return;
+    }
+}
+
+COWMatrix<QPoint> ShardedSimilarityMapper::iterate(const QImage& dst)
+{
+    TRACE_ME
+
+    if (failed_ || shards_.isEmpty())
+        return COWMatrix<QPoint>();
+
+    for (int n=0; n<shards_.size(); ++n) {
+        const Shard& shard = shards_[n];
+
+        QByteArray message;
+        QDataStream stream(&message, QIODevice::WriteOnly);
+        stream << (quint8)CommandBegin << (qint32)passCount_;
+        write_image(stream, dst.copy(0, shard.tileBegin, dst.width(), shard.tileEnd - shard.tileBegin));
+        if (!send(n, message))
+            return COWMatrix<QPoint>();
+    }
+
+    // every worker runs the same settings, so the same number of passes
+    qint32 pass_count = 0;
+    for (int n=0; n<shards_.size(); ++n) {
+        QByteArray reply;
+        if (!receive(n, &reply))
+            return COWMatrix<QPoint>();
+        QDataStream(reply) >> pass_count;
+    }
+
+    for (int pass=0; pass<pass_count; ++pass) {
+        QByteArray pass_message;
+        QDataStream(&pass_message, QIODevice::WriteOnly) << (quint8)CommandPass << (qint32)pass;
+        for (int n=0; n<shards_.size(); ++n)
+            if (!send(n, pass_message))
+                return COWMatrix<QPoint>();
+
+        QVector<NnField> top_edges(shards_.size());
+        QVector<NnField> bottom_edges(shards_.size());
+        for (int n=0; n<shards_.size(); ++n) {
+            QByteArray reply;
+            if (!receive(n, &reply))
+                return COWMatrix<QPoint>();
+            QDataStream stream(reply);
+            top_edges[n] = read_field(stream);
+            bottom_edges[n] = read_field(stream);
+        }
+
+        // edges of every band become aprons of its neighbours
+        for (int n=0; n<shards_.size(); ++n) {
+            QByteArray message;
+            QDataStream stream(&message, QIODevice::WriteOnly);
+            stream << (quint8)CommandHalo;
+            write_field(stream, (n > 0)?bottom_edges[n-1]:NnField());
+            write_field(stream, (n+1 < shards_.size())?top_edges[n+1]:NnField());
+            if (!send(n, message))
+                return COWMatrix<QPoint>();
+        }
+
+        if (deadline_ >= 0 && clock_.elapsed() >= deadline_)
+            break;
+    }
+
+    QByteArray end_message;
+    QDataStream(&end_message, QIODevice::WriteOnly) << (quint8)CommandEnd;
+    for (int n=0; n<shards_.size(); ++n)
+        if (!send(n, end_message))
+            return COWMatrix<QPoint>();
+
+    // the bands are collected first, a worker lost now
+    // must not leave field_ half updated
+    QVector<NnField> bands(shards_.size());
+    for (int n=0; n<shards_.size(); ++n) {
+        QByteArray reply;
+        if (!receive(n, &reply))
+            return COWMatrix<QPoint>();
+        QDataStream stream(reply);
+        bands[n] = read_field(stream);
+    }
+
+    if (field_.isNull()) {
+        field_.offsets = COWMatrix<QPoint>(dst.size());
+        field_.scores = COWMatrix<int>(dst.size());
+        field_.reliabilities = COWMatrix<qreal>(dst.size());
+    }
+
+    for (int n=0; n<shards_.size(); ++n) {
+        const NnField& band = bands[n];
+
+        for (int j=0; j<band.offsets.height(); ++j)
+            for (int i=0; i<band.offsets.width(); ++i) {
+                int row = shards_[n].begin + j;
+                field_.offsets.set(i, row, band.offsets.get(i, j));
+                field_.scores.set(i, row, band.scores.get(i, j));
+                field_.reliabilities.set(i, row, band.reliabilities.get(i, j));
+            }
+    }
+
+    report_max_score();
+
+    return field_.offsets;
+}
+
+bool ShardedSimilarityMapper::send(int shard, const QByteArray& message)
+{
+    QProcess* process = shards_[shard].process;
+
+    bool ok = write_message(process, message);
+    while (ok && process->bytesToWrite() > 0)
+        ok = process->waitForBytesWritten(timeout());
+
+    if (!ok)
+        fail(shard);
+    return ok;
+}
+
+bool ShardedSimilarityMapper::receive(int shard, QByteArray* message)
+{
+    QProcess* process = shards_[shard].process;
+
+    bool ok = read_message(process, message, timeout());
+
+    // worker diagnostics
+    std::cerr << process->readAllStandardError().constData();
+
+    if (!ok)
+        fail(shard);
+    return ok;
+}
+
+int ShardedSimilarityMapper::timeout() const
+{
+    if (deadline_ < 0)
+        return WORKER_TIMEOUT_MSEC;
+    return qMax(0, deadline_ - clock_.elapsed()) + WORKER_GRACE_MSEC;
+}
+
+void ShardedSimilarityMapper::fail(int shard)
+{
+    qDebug() << "shard" << shard << ": worker is gone or not answering";
+    failed_ = true;
+    // the others wait for their neighbours' edges, nothing more can be
+    // done with them; a hung worker wouldn't take the quit command
+    foreach(const Shard& s, shards_)
+        s.process->kill();
+    stop();
+}
+
+void ShardedSimilarityMapper::report_max_score()
+{
+    // same points as SimilarityMapper fills, every unknown pixel
+    // including the image border
+    maxScore_ = 0;
+    int min_score = INT_MAX;
+    meanScore_ = 0;
+    int count = 0;
+
+    for (int j=0; j<dstMask_.height(); ++j)
+        for (int i=dstMask_.nextClear(j, 0); i<dstMask_.width(); i=dstMask_.nextClear(j, i+1)) {
+            int score = field_.scores.get(i, j);
+            maxScore_ = qMax(maxScore_, score);
+            min_score = qMin(min_score, score);
+            meanScore_ += score;
+            ++count;
+        }
+
+    if (count)
+        meanScore_ /= count;
+
+    qDebug() << "sharded score : max =" << maxScore_
+        << "mean =" << meanScore_
+        << "min =" << min_score;
+}
+
+int run_shard_worker()
+{
+    QFile in, out;
+    if (!in.open(0, QIODevice::ReadOnly) || !out.open(1, QIODevice::WriteOnly))
+        return 1;
+
+    SimilarityMapper sm;
+
+    // placement of the tile and the source in the full image
+    // and of the band in the tile
+    qint32 tile_top = 0;
+    qint32 src_top = 0;
+    int shift = 0;
+    qint32 band_begin = 0;
+    qint32 band_end = 0;
+    int width = 0;
+    int tile_height = 0;
+
+    QByteArray message;
+    while (read_message(&in, &message)) {
+        QDataStream stream(message);
+        quint8 command;
+        stream >> command;
+
+        QByteArray reply;
+        QDataStream reply_stream(&reply, QIODevice::WriteOnly);
+
+        switch (command) {
+        case CommandInit: {
+            qint32 engine, weights, layout, threads, max_displacement;
+            stream >> tile_top >> src_top >> band_begin >> band_end >> engine >> weights >> layout >> threads
+                >> max_displacement;
+            QImage src = read_image(stream);
+            BitMask src_mask = read_mask(stream);
+            QImage dst = read_image(stream);
+            BitMask dst_mask = read_mask(stream);
+
+            width = dst.width();
+            tile_height = dst.height();
+            shift = tile_top - src_top;
+
+            QThreadPool::globalInstance()->setMaxThreadCount(threads);
+            sm.setThreadPool(QThreadPool::globalInstance(), threads*JOB_CHUNK_COUNT);
+            sm.setEngine(SimilarityMapperEngine(engine));
+            sm.setWeightMode(SimilarityMapperWeights(weights));
+            sm.setSourceLayout(SimilarityMapperLayout(layout));
+            // tile offsets are shifted, see shift_offsets
+            sm.setMaxDisplacement(max_displacement, QPoint(0, shift));
+            // the aprons are only read, their neighbours map them
+            sm.setMappedRows(band_begin, band_end);
+            sm.init(src, dst, src_mask, dst_mask);
+            continue;
+        }
+
+        case CommandSeed:
+            sm.seed(read_matrix<QPoint>(stream));
+            continue;
+
+        case CommandBegin: {
+            qint32 pass_count;
+            stream >> pass_count;
+            QImage dst = read_image(stream);
+            if (pass_count > 0)
+                sm.setPassCount(pass_count);
+            reply_stream << (qint32)sm.beginPasses(dst);
+            break;
+        }
+
+        case CommandPass: {
+            qint32 pass;
+            stream >> pass;
+            sm.runPass(pass);
+
+            // a band has an apron on the sides with a neighbour
+            NnField top, bottom;
+            if (band_begin > 0)
+                top = sm.fieldRegion(QRect(0, band_begin, width, APRON));
+            if (band_end < tile_height)
+                bottom = sm.fieldRegion(QRect(0, band_end - APRON, width, APRON));
+            shift_offsets(&top.offsets, -shift);
+            shift_offsets(&bottom.offsets, -shift);
+            write_field(reply_stream, top);
+            write_field(reply_stream, bottom);
+            break;
+        }
+
+        case CommandHalo: {
+            NnField top = read_field(stream);
+            NnField bottom = read_field(stream);
+            shift_offsets(&top.offsets, shift);
+            shift_offsets(&bottom.offsets, shift);
+            if (!top.isNull())
+                sm.setFieldRegion(QPoint(0, 0), top);
+            if (!bottom.isNull())
+                sm.setFieldRegion(QPoint(0, band_end), bottom);
+            continue;
+        }
+
+        case CommandEnd: {
+            sm.endPasses();
+            NnField band = sm.fieldRegion(QRect(0, band_begin, width, band_end - band_begin));
+            shift_offsets(&band.offsets, -shift);
+            write_field(reply_stream, band);
+            break;
+        }
+
+        case CommandQuit:
+            return 0;
+
+        default:
+            qDebug() << "shard worker: unknown command" << command;
+            return 1;
+        }
+
+        if (!write_message(&out, reply) || !out.flush())
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,124 @@
+#ifndef UNSEEIT_SHARDEDMAPPER_H
+#define UNSEEIT_SHARDEDMAPPER_H
+
+#include <QImage>
+#include <QString>
+#include <QTime>
+#include <QVector>
+
+#include "bitmask.h"
+#include "cowmatrix.h"
+#include "knnfield.h"
+#include "nnfcache.h"
+#include "similaritymapper.h"
+
+class QProcess;
+
+// SimilarityMapper spread over worker processes.
+//
+// The dst is cut into horizontal bands, one per worker. A worker keeps its
+// band plus an apron of R+1 rows of each neighbouring band, enough for the
+// patches of its edge rows and for propagation across the seam; only the band
+// is mapped. After every pass the workers send the edge rows of their own
+// bands, which become the aprons of their neighbours before the next pass.
+// With a maximum displacement a worker gets only the source rows its tile
+// can reach, otherwise the whole source.
+//
+// Workers are started as workerProgram --shard-worker and talk over
+// stdin/stdout; the program must answer that flag with run_shard_worker,
+// as unseeit does. By default it is the running executable, which is only
+// right for unseeit itself. Offsets on the wire are always in full image
+// coordinates.
+//
+// Covers what Resynthesizer needs from a mapper; the k nearest
+// neighbours mode is not sharded.
+class ShardedSimilarityMapper
+{
+public:
+    // empty workerProgram means the running executable
+    ShardedSimilarityMapper(int shardCount, const QString& workerProgram = QString());
+    ~ShardedSimilarityMapper();
+
+    void setEngine(SimilarityMapperEngine engine) { engine_ = engine; }
+    void setWeightMode(SimilarityMapperWeights weights) { weights_ = weights; }
+    void setSourceLayout(SimilarityMapperLayout layout) { layout_ = layout; }
+
+    // like SimilarityMapper::setMaxDisplacement, call before init
+    void setMaxDisplacement(int d) { maxDisplacement_ = d; }
+
+    // passes per iterate call, 0 keeps the SimilarityMapper default
+    void setPassCount(int passCount) { passCount_ = passCount; }
+
+    // like SimilarityMapper::setDeadline, checked between passes
+    // of all shards
+    void setDeadline(const QTime& clock, int msec) { clock_ = clock; deadline_ = msec; }
+
+    // src, dst - argb32, srcMask - valid source centres,
+    // dstMask - known dst pixels;
+    // false if dst is too small to be worth splitting
+    // or the workers could not be started
+    bool init(const QImage& src, const QImage& dst, const BitMask& srcMask, const BitMask& dstMask);
+
+    void seed(const COWMatrix<QPoint>& offsets);
+    // null once a worker has died or stopped answering,
+    // the remaining workers are stopped then
+    COWMatrix<QPoint> iterate(const QImage& dst);
+
+    // a worker was lost since init, the level has to be mapped otherwise
+    bool failed() const { return failed_; }
+
+    NnField field() const { return field_; }
+    const COWMatrix<qreal> reliabilityMap() const { return field_.reliabilities; }
+    KnnField knnField() const { return KnnField(); }
+
+    double meanScore() const { return meanScore_; }
+    int maxScore() const { return maxScore_; }
+
+private:
+    struct Shard
+    {
+        QProcess* process;
+        // rows of the band this shard owns
+        int begin;
+        int end;
+        // rows it keeps, band and aprons
+        int tileBegin;
+        int tileEnd;
+        // source rows it gets
+        int srcBegin;
+        int srcEnd;
+    };
+
+    // false if the worker is gone, after stopping all of them
+    bool send(int shard, const QByteArray& message);
+    bool receive(int shard, QByteArray* message);
+    void fail(int shard);
+    // msec to wait for a worker, from the deadline if there is one
+    int timeout() const;
+    void report_max_score();
+    void stop();
+
+    QVector<Shard> shards_;
+    int shardCount_;
+    QString workerProgram_;
+    bool failed_;
+
+    SimilarityMapperEngine engine_;
+    SimilarityMapperWeights weights_;
+    SimilarityMapperLayout layout_;
+    int maxDisplacement_;
+    int passCount_;
+    QTime clock_;
+    int deadline_;
+
+    BitMask dstMask_;
+    NnField field_;
+
+    double meanScore_;
+    int maxScore_;
+};
+
+// main loop of a --shard-worker process, returns the exit code
+int run_shard_worker();
+
+#endif
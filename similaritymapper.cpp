@@ -3,13 +3,16 @@
 #include <limits>
 #include <algorithm>
 #include <iostream>
+#include <string.h>
 
-#include <QtConcurrentMap>
+#include <QHash>
+#include <QThreadPool>
 #include <qmath.h>
 
 #include <boost/bind/bind.hpp>
 
 #include "consts.h"
+#include "parallel.h"
 #include "pixel.h"
 #include "randomoffsetgenerator.h"
 #include "utils.h"
@@ -17,12 +20,231 @@
 const int R = 4;
 const int PASS_COUNT = 12;
 
+// the descriptor index engine only needs a few passes to clean up
+const int INDEX_PASS_COUNT = 4;
+const int INDEX_CANDIDATES = 4;
+const int INDEX_MAX_LEAVES = 16;
+
+const int MAX_NEIGHBOUR_COUNT = 16;
+
+// random search candidates per pixel and pass, at most one per halving
+// of an int range
+const int MAX_SEARCH_CANDIDATES = 33;
+
+// random search ranges are kept per block of that many pixels square,
+// a block's range is twice its longest recent improvement, and halves
+// every pass without one, but never drops below MIN_SEARCH_RANGE
+const int SEARCH_BLOCK = 32;
+const int MIN_SEARCH_RANGE = 4;
+
 const double QREAL_MIN = std::numeric_limits<qreal>::min();
 
 // this value can be varied from "omg blurry" to "wtf is that?!"
 const double SIGMA2 = (2*R+1)*(2*R+1)*0.2f;
 
-void SimilarityMapper::init(const QImage& src, const QImage& dst)
+const int FIXED_ONE = 65535;
+
+// seed scores pixels sharing an offset within a band of rows together
+// when the box they span is at most that many pixels per pixel scored;
+// a direct patch distance costs (2R+1)^2 pixel reads, a box filtered
+// one about a read and four additions per pixel of the box
+const int BOX_MAX_AREA_PER_POINT = 16;
+const int BOX_BAND_ROWS = 64;
+
+namespace {
+
+// pixels that differ between two images of the same size
+BitMask changed_pixels(const ImageView& before, const ImageView& after)
+{
+    BitMask result(after.size());
+    if (before.bits() == after.bits())
+        return result;
+
+    for (int j=0; j<after.height(); ++j) {
+        const QRgb* a = before.scanLine(j);
+        const QRgb* b = after.scanLine(j);
+        if (!memcmp(a, b, 4*after.width()))
+            continue;
+        for (int i=0; i<after.width(); ++i)
+            if (a[i] != b[i])
+                result.set(i, j);
+    }
+
+    return result;
+}
+
+// sums over all (2r+1)x(2r+1) windows of values, the window with
+// its top left corner at (i, j) goes to (i, j);
+// with doubles exact as long as the sums are integers below 2^53
+template <typename T>
+COWMatrix<T> box_filter(const COWMatrix<T>& values, int r)
+{
+    int size = 2*r+1;
+    int width = values.width() - 2*r;
+    int height = values.height() - 2*r;
+    if (width <= 0 || height <= 0)
+        return COWMatrix<T>();
+
+    // running sums along rows
+    COWMatrix<T> row_sums(width, values.height());
+    for (int j=0; j<values.height(); ++j) {
+        const T* row = values.ptrAt(0, j);
+        T sum = 0;
+        for (int i=0; i<size; ++i)
+            sum += row[i];
+        row_sums.set(0, j, sum);
+        for (int i=1; i<width; ++i) {
+            sum += row[i+2*r] - row[i-1];
+            row_sums.set(i, j, sum);
+        }
+    }
+
+    // then down the columns, a row at a time
+    COWMatrix<T> result(width, height);
+    QVector<T> sums(width, 0);
+    for (int j=0; j<size; ++j)
+        for (int i=0; i<width; ++i)
+            sums[i] += row_sums.get(i, j);
+    for (int j=0; j<height; ++j) {
+        if (j > 0)
+            for (int i=0; i<width; ++i)
+                sums[i] += row_sums.get(i, j+2*r) - row_sums.get(i, j-1);
+        for (int i=0; i<width; ++i)
+            result.set(i, j, sums[i]);
+    }
+
+    return result;
+}
+
+// channel sums of the patch around every pixel of an image,
+// given the image padded by R
+COWMatrix<PatchSum> patch_sums(const QImage& padded)
+{
+    PatchSum zero = {{0, 0, 0, 0}};
+    COWMatrix<PatchSum> result(padded.width()-2*R, padded.height()-2*R, zero);
+
+    for (int c=0; c<4; ++c) {
+        COWMatrix<int> channel(padded.size());
+        for (int j=0; j<padded.height(); ++j) {
+            const quint8* rgb = padded.scanLine(j);
+            for (int i=0; i<padded.width(); ++i)
+                channel.set(i, j, rgb[4*i + c]);
+        }
+
+        COWMatrix<int> sums = box_filter(channel, R);
+        for (int j=0; j<sums.height(); ++j)
+            for (int i=0; i<sums.width(); ++i)
+                result.ptrAt(i, j)->channels[c] = sums.get(i, j);
+    }
+
+    return result;
+}
+
+qint64 group_key(QPoint offset, int band)
+{
+    return ((qint64)offset.x() << 40) ^ ((qint64)offset.y() << 16) ^ band;
+}
+
+// reliabilities for every integer score, so passes don't call qExp
+struct ReliabilityTables
+{
+    ReliabilityTables() {
+        // beyond that exp underflows and the result is clamped anyway
+        for (int score=0; ; ++score) {
+            qreal value = qExp(-score/SIGMA2);
+            if (value < QREAL_MIN)
+                break;
+            exact << value;
+        }
+
+        for (int score=0; ; ++score) {
+            int value = qRound(FIXED_ONE*qExp(-score/SIGMA2));
+            if (value < 1)
+                break;
+            fixed << value;
+        }
+    }
+
+    QVector<qreal> exact;
+    QVector<quint16> fixed;
+};
+
+const ReliabilityTables& reliabilityTables()
+{
+    static const ReliabilityTables tables;
+    return tables;
+}
+
+};
+
+SimilarityMapper::SimilarityMapper(QObject* parent): QObject(parent),
+    neighbourCount_(1), weights_(SMWeightsDouble), engine_(SMEnginePatchMatch),
+    layout_(SMLayoutRowMajor), index_(R),
+    initSearchRange_(0), mappedBegin_(0), mappedEnd_(INT_MAX), maxDisplacement_(-1),
+    passCount_(PASS_COUNT), deadline_(-1),
+    pool_(QThreadPool::globalInstance()), chunkCount_(JOB_CHUNK_COUNT)
+{
+}
+
+void SimilarityMapper::setThreadPool(QThreadPool* pool, int chunkCount)
+{
+    pool_ = pool;
+    chunkCount_ = qMax(1, chunkCount);
+}
+
+qreal SimilarityMapper::scoreToReliability(int score)
+{
+    const QVector<qreal>& table = reliabilityTables().exact;
+    return (score >= 0 && score < table.size())?table[score]:QREAL_MIN;
+}
+
+quint16 SimilarityMapper::scoreToFixedReliability(int score)
+{
+    const QVector<quint16>& table = reliabilityTables().fixed;
+    return (score >= 0 && score < table.size())?table[score]:1;
+}
+
+void SimilarityMapper::setScore(QPoint p, int score)
+{
+    qreal reliability = scoreToReliability(score);
+    scoreMap_.set(p, score);
+    reliabilityMap_.set(p, reliability);
+    if (SMWeightsFixed == weights_)
+        fixedReliabilityMap_.set(p + QPoint(R, R), scoreToFixedReliability(score));
+    else
+        weightMap_.set(p + QPoint(R, R), reliability);
+}
+
+void SimilarityMapper::setWeight(QPoint p, qreal reliability)
+{
+    if (SMWeightsFixed == weights_)
+        fixedReliabilityMap_.set(p + QPoint(R, R), quantizeReliability(reliability));
+    else
+        weightMap_.set(p + QPoint(R, R), reliability);
+}
+
+void SimilarityMapper::updateWeightMaps()
+{
+    QSize padded_size = reliabilityMap_.size() + QSize(2*R, 2*R);
+    if (SMWeightsFixed == weights_) {
+        weightMap_ = COWMatrix<qreal>();
+        fixedReliabilityMap_ = COWMatrix<quint16>(padded_size, 0);
+    } else {
+        weightMap_ = COWMatrix<qreal>(padded_size, 0.0);
+        fixedReliabilityMap_ = COWMatrix<quint16>();
+    }
+
+    for (int j=0; j<reliabilityMap_.height(); ++j)
+        for (int i=0; i<reliabilityMap_.width(); ++i)
+            setWeight(QPoint(i, j), reliabilityMap_.get(i, j));
+}
+
+quint16 SimilarityMapper::quantizeReliability(qreal reliability)
+{
+    return qBound(1, qRound(FIXED_ONE*reliability), FIXED_ONE);
+}
+
+void SimilarityMapper::init(const ImageView& src, const ImageView& dst)
 {
     TRACE_ME
 
@@ -30,34 +252,42 @@ void SimilarityMapper::init(const QImage& src, const QImage& dst)
 
     // offsetmap has the same dimensions as dst
     offsetMap_ = COWMatrix<QPoint>(dst.size());
-    src_ = src;
-    auto srcMask = QImage(src.size(), QImage::Format_Mono);
-    srcMask.fill(1);
+    paddedSrc_ = padded_image(src, R);
+    paddedDst_ = padded_image(dst, R);
+    src_ = ImageView(paddedSrc_).cropped(QRect(QPoint(R, R), src.size()));
+    dst_ = ImageView(paddedDst_).cropped(QRect(QPoint(R, R), dst.size()));
+    srcSums_ = patch_sums(paddedSrc_);
+    dstSums_ = patch_sums(paddedDst_);
+    srcTiles_ = (SMLayoutTiled == layout_)?SourceTiles(paddedSrc_, R):SourceTiles();
+    validSources_ = BitMask(src.size(), true);
+    dstMask_ = BitMask();
 
     scoreMap_ = COWMatrix<int>(dst.size());
     scoreMap_.fill(INT_MAX);
     reliabilityMap_ = COWMatrix<qreal>(scoreMap_.size(), QREAL_MIN);
 
     // fill offsetmap with random offsets for unknows points
-    RandomOffsetGenerator rog(srcMask, R);
+    RandomOffsetGenerator rog(validSources_, 0);
     for (int j=0; j<offsetMap_.height(); ++j)
         for (int i=0; i<offsetMap_.width(); ++i)
-            offsetMap_.set(i, j, rog(i, j));
+            offsetMap_.set(i, j, clampOffset(rog(i, j)));
+    searchRanges_ = COWMatrix<int>((dst.width() + SEARCH_BLOCK-1)/SEARCH_BLOCK,
+            (dst.height() + SEARCH_BLOCK-1)/SEARCH_BLOCK, INT_MAX);
 
     // create list of unknown points
-    for (int j=R; j<dst.height()-R; ++j) {
-        for (int i=R, i_end = dst.width()-R; i<i_end; ++i)
-            pointsToFill_ << QPoint(i, j);
+    pointsToFill_.clear();
+    for (int j=qMax(0, mappedBegin_); j<qMin(dst.height(), mappedEnd_); ++j)
+        for (int i=0; i<dst.width(); ++i)
+            pointsToFill_.append(QPoint(i, j));
 
-        for (int i=dst.width()-1; i >= 0; --i)
-            reversePointsToFill_ << QPoint(i, j);
-    }
+    initKnn();
+    updateWeightMaps();
 
     qDebug() << pointsToFill_.size() << "points to map";
 }
 
-void SimilarityMapper::init(const QImage& src,
-        const QImage& dst, const QImage& srcMask, const QImage& dstMask)
+void SimilarityMapper::init(const ImageView& src,
+        const ImageView& dst, const BitMask& srcMask, const BitMask& dstMask)
 {
     TRACE_ME
 
@@ -65,8 +295,14 @@ void SimilarityMapper::init(const QImage& src,
 
     // offsetmap has the same dimensions as dst
     offsetMap_ = COWMatrix<QPoint>(dst.size());
-    src_ = src;
-    srcMask_ = srcMask;
+    paddedSrc_ = padded_image(src, R);
+    paddedDst_ = padded_image(dst, R);
+    src_ = ImageView(paddedSrc_).cropped(QRect(QPoint(R, R), src.size()));
+    dst_ = ImageView(paddedDst_).cropped(QRect(QPoint(R, R), dst.size()));
+    srcTiles_ = (SMLayoutTiled == layout_)?SourceTiles(paddedSrc_, R):SourceTiles();
+    srcSums_ = COWMatrix<PatchSum>();
+    dstSums_ = COWMatrix<PatchSum>();
+    validSources_ = srcMask;
     dstMask_ = dstMask;
 
     scoreMap_ = COWMatrix<int>(dst.size());
@@ -75,42 +311,493 @@ void SimilarityMapper::init(const QImage& src,
 
     // fill offsetmap with random offsets for unknows points
     offsetMap_.fill(QPoint(0, 0));
-    RandomOffsetGenerator rog(srcMask, R);
+    RandomOffsetGenerator rog(validSources_, 0);
+    for (int j=0; j<offsetMap_.height(); ++j)
+        for (int i=dstMask.nextClear(j, 0); i<offsetMap_.width(); i=dstMask.nextClear(j, i+1)) {
+            offsetMap_.set(i, j, clampOffset(rog(i, j)));
+            scoreMap_.set(i, j, INT_MAX);
+            reliabilityMap_.set(i, j, QREAL_MIN);
+        }
+    searchRanges_ = COWMatrix<int>((dst.width() + SEARCH_BLOCK-1)/SEARCH_BLOCK,
+            (dst.height() + SEARCH_BLOCK-1)/SEARCH_BLOCK, INT_MAX);
+
+    // create list of unknown points, a run of them at a time
+    pointsToFill_.clear();
+    for (int j=qMax(0, mappedBegin_); j<qMin(dst.height(), mappedEnd_); ++j)
+        for (int i=dstMask.nextClear(j, 0); i<dst.width(); ) {
+            int run_end = dstMask.nextSet(j, i);
+            for (; i<run_end; ++i)
+                pointsToFill_.append(QPoint(i, j));
+            i = dstMask.nextClear(j, run_end);
+        }
+
+    initKnn();
+    updateWeightMaps();
+
+    qDebug() << pointsToFill_.size() << "points to map";
+}
+
+void SimilarityMapper::initKnn()
+{
+    if (neighbourCount_ <= 1) {
+        knn_ = KnnField();
+        return;
+    }
+
+    knn_ = KnnField(offsetMap_.size(), qMin(neighbourCount_, MAX_NEIGHBOUR_COUNT));
     for (int j=0; j<offsetMap_.height(); ++j)
         for (int i=0; i<offsetMap_.width(); ++i)
-            if (!dstMask.pixelIndex(i, j)) {
-                offsetMap_.set(i, j, rog(i, j));
-                scoreMap_.set(i, j, INT_MAX);
-                reliabilityMap_.set(i, j, QREAL_MIN);
+            knn_.reset(QPoint(i, j), offsetMap_.get(i, j), scoreMap_.get(i, j));
+}
+
+void SimilarityMapper::rescore(const BitMask& dirty)
+{
+    TRACE_ME
+
+    QPolygon points;
+    for (FillSpans::Iterator it = pointsToFill_.begin(FillSpans::TopDownLeftRight); !it.atEnd(); ++it)
+        if (dirty.test(*it))
+            points << *it;
+    if (points.isEmpty())
+        return;
+
+    if (!knn_.isNull())
+        knn_.detach();
+
+    QVector<QVector<RandomSearchResult> > results(chunkCount_);
+    parallel_for_chunks(pool_, chunkCount_,
+            boost::bind(&SimilarityMapper::rescoreForChunk, this,
+                &points, results.data(), _1));
+
+    // offsets stay, the knn slots already hold the new scores
+    applyResults(results);
+
+    qDebug() << points.size() << "patches rescored";
+}
+
+// writes only to the knn slots of its points, so it can run in parallel
+void SimilarityMapper::rescoreForChunk(const QPolygon* points,
+        QVector<RandomSearchResult>* results, int chunk)
+{
+    int begin, end;
+    chunkRange(points->size(), chunk, &begin, &end);
+
+    QVector<RandomSearchResult>& chunk_results = results[chunk];
+    chunk_results.reserve(end-begin);
+
+    for (int n=begin; n<end; ++n) {
+        RandomSearchResult result;
+        result.point = points->at(n);
+        result.offset = offsetMap_.get(result.point);
+        result.score = INT_MAX;
+
+        if (knn_.isNull()) {
+            QPoint current = result.offset;
+            updateSource(result.point, &result.offset, current, &result.score);
+        } else {
+            // the heap order depends on the scores, so it is rebuilt
+            int k = knn_.k();
+            QPoint* offsets = knn_.offsets(result.point);
+            int* scores = knn_.scores(result.point);
+            QPoint old_offsets[MAX_NEIGHBOUR_COUNT];
+            int old_scores[MAX_NEIGHBOUR_COUNT];
+            std::copy(offsets, offsets+k, old_offsets);
+            std::copy(scores, scores+k, old_scores);
+            std::fill(scores, scores+k, INT_MAX);
+
+            for (int c=0; c<k; ++c) {
+                if (old_scores[c] == INT_MAX)
+                    continue;
+                QPoint unused;
+                int score = INT_MAX;
+                if (updateSource(result.point, &unused, old_offsets[c], &score))
+                    KnnField::insert(offsets, scores, k, old_offsets[c], score);
             }
 
-    // create list of unknown points
-    for (int j=R; j<dst.height()-R; ++j) {
-        for (int i=R, i_end = dst.width()-R; i<i_end; ++i)
-            if (!dstMask.pixelIndex(i, j))
-                pointsToFill_ << QPoint(i, j);
+            // nothing valid left, the offset stays as it is
+            QPoint best_offset;
+            int best_score = KnnField::best(offsets, scores, k, &best_offset);
+            if (best_score != INT_MAX) {
+                result.offset = best_offset;
+                result.score = best_score;
+            }
+        }
 
-        for (int i=dst.width()-1; i >= 0; --i)
-            if (!dstMask.pixelIndex(i, j))
-                reversePointsToFill_ << QPoint(i, j);
+        chunk_results.push_back(result);
     }
+}
 
-    qDebug() << pointsToFill_.size() << "points to map";
+void SimilarityMapper::seed(const COWMatrix<QPoint>& offsets)
+{
+    TRACE_ME
+
+    Q_ASSERT(offsets.size() == offsetMap_.size());
+
+    // upscaled fields and coherent regions have lots of neighbours
+    // sharing an offset, they are scored together
+    QHash<qint64, QPolygon> groups;
+    for (FillSpans::Iterator it = pointsToFill_.begin(FillSpans::TopDownLeftRight); !it.atEnd(); ++it)
+        groups[group_key(offsets.get(*it), (*it).y()/BOX_BAND_ROWS)] << *it;
+
+    QVector<QPolygon> box_groups;
+    QPolygon single_points;
+    foreach(const QPolygon& group, groups) {
+        QRect area = group.boundingRect().adjusted(-R, -R, R, R);
+        if (area.width()*area.height() <= BOX_MAX_AREA_PER_POINT*group.size())
+            box_groups << group;
+        else
+            single_points << group;
+    }
+
+    QVector<QVector<RandomSearchResult> > opinions(2*chunkCount_);
+    parallel_for_chunks(pool_, chunkCount_,
+            boost::bind(&SimilarityMapper::seedForChunk, this,
+                &single_points, &offsets, opinions.data(), _1));
+    parallel_for_chunks(pool_, chunkCount_,
+            boost::bind(&SimilarityMapper::boxSeedForChunk, this,
+                &box_groups, &offsets, opinions.data() + chunkCount_, _1));
+
+    qDebug() << pointsToFill_.size() - single_points.size() << "points seeded in"
+        << box_groups.size() << "groups";
+
+    foreach(const QVector<RandomSearchResult>& chunk_opinions, opinions)
+        foreach(RandomSearchResult rsr, chunk_opinions) {
+            offsetMap_.set(rsr.point, rsr.offset);
+            setScore(rsr.point, rsr.score);
+            if (!knn_.isNull())
+                knn_.reset(rsr.point, rsr.offset, rsr.score);
+        }
+
+    // rows left out by setMappedRows only lend their offsets to
+    // propagation, they are taken unscored
+    for (int j=0; j<offsetMap_.height(); ++j) {
+        if (j >= mappedBegin_ && j < mappedEnd_)
+            continue;
+        for (int i=0; i<offsetMap_.width(); ++i) {
+            QPoint p(i, j);
+            if ((dstMask_.isNull() || !dstMask_.test(p)) && isValidSource(p, p + offsets.get(p)))
+                offsetMap_.set(p, offsets.get(p));
+        }
+    }
+
+    report_max_score();
+}
+
+void SimilarityMapper::seedForChunk(const QPolygon* points, const COWMatrix<QPoint>* offsets,
+        QVector<RandomSearchResult>* results, int chunk) const
+{
+    int begin, end;
+    chunkRange(points->size(), chunk, &begin, &end);
+
+    QVector<RandomSearchResult>& chunk_results = results[chunk];
+    chunk_results.reserve(end-begin);
+
+    for (int i=begin; i<end; ++i) {
+        RandomSearchResult result;
+        result.point = points->at(i);
+        result.offset = offsetMap_.get(result.point);
+        result.score = INT_MAX;
+        updateSource(result.point, &result.offset, offsets->get(result.point), &result.score);
+        chunk_results.push_back(result);
+    }
 }
 
-QVector<RandomSearchResult> SimilarityMapper::performRandomSearchForRange(QPolygon points) const
+void SimilarityMapper::boxSeedForChunk(const QVector<QPolygon>* groups,
+        const COWMatrix<QPoint>* offsets, QVector<RandomSearchResult>* results, int chunk) const
 {
-    QVector<RandomSearchResult> results;
-    results.reserve(points.size());
+    int begin, end;
+    chunkRange(groups->size(), chunk, &begin, &end);
+
+    for (int i=begin; i<end; ++i) {
+        const QPolygon& group = groups->at(i);
+        boxScoreGroup(offsets->get(group.first()), group, &results[chunk]);
+    }
+}
+
+// The same distances as updateSource gives for every point of the group,
+// from per-pixel differences computed once for the box the patches cover.
+// Integer sums stay exact in doubles, so simple and fixed weight scores
+// are identical to the direct ones, double weight ones may differ by
+// rounding.
+void SimilarityMapper::boxScoreGroup(QPoint offset, const QPolygon& points,
+        QVector<RandomSearchResult>* results) const
+{
+    // patches of points which don't fit here are out of src anyway;
+    // in unpadded coordinates, the aprons are part of both images
+    QRect area = points.boundingRect().adjusted(-R, -R, R, R)
+        .intersected(dst_.rect().adjusted(-R, -R, R, R))
+        .intersected(src_.rect().adjusted(-R, -R, R, R).translated(-offset));
+
+    bool weighted = (SMModeMasked == mode_);
+    bool fixed = weighted && SMWeightsFixed == weights_;
+
+    COWMatrix<double> diffs(area.size());
+    COWMatrix<double> weights(area.size(), 1.0);
+    for (int j=0; j<area.height(); ++j) {
+        // padded coordinates
+        QPoint p = area.topLeft() + QPoint(R, R+j);
+        QPoint s = p + offset;
+        const quint8* np_rgb = paddedDst_.scanLine(p.y()) + 4*p.x();
+        const quint8* ns_rgb = paddedSrc_.scanLine(s.y()) + 4*s.x();
+
+        for (int i=0; i<area.width(); ++i) {
+            double weight = 1.0;
+            if (fixed)
+                weight = fixedReliabilityMap_.get(p.x()+i, p.y());
+            else if (weighted)
+                weight = weightMap_.get(p.x()+i, p.y());
+
+            diffs.set(i, j, ssd4(ns_rgb + 4*i, np_rgb + 4*i)*weight);
+            weights.set(i, j, weight);
+        }
+    }
+
+    COWMatrix<double> diff_sums = box_filter(diffs, R);
+    COWMatrix<double> weight_sums = weighted?box_filter(weights, R):COWMatrix<double>();
 
     foreach(QPoint p, points) {
-        results.push_back(randomSearchKernel(p));
+        RandomSearchResult result;
+        result.point = p;
+        result.offset = offsetMap_.get(p);
+        result.score = INT_MAX;
+
+        if (isValidSource(p, p + offset)) {
+            QPoint corner = p - QPoint(R, R) - area.topLeft();
+            double sum = diff_sums.get(corner);
+
+            result.offset = offset;
+            if (!weighted)
+                result.score = (qint64)sum;
+            else if (fixed)
+                result.score = (qint64)sum/(qint64)weight_sums.get(corner);
+            else
+                result.score = sum/weight_sums.get(corner);
+        }
+
+        results->push_back(result);
     }
+}
+
+void SimilarityMapper::restore(const NnField& field)
+{
+    Q_ASSERT(field.offsets.size() == offsetMap_.size());
+
+    offsetMap_ = field.offsets;
+    scoreMap_ = field.scores;
+    reliabilityMap_ = field.reliabilities;
+    initKnn();
+    updateWeightMaps();
+}
+
+NnField SimilarityMapper::field() const
+{
+    NnField result;
+    result.offsets = offsetMap_;
+    result.scores = scoreMap_;
+    result.reliabilities = reliabilityMap_;
+    return result;
+}
 
-    return results;
+NnField SimilarityMapper::fieldRegion(const QRect& rect) const
+{
+    NnField result;
+    result.offsets = COWMatrix<QPoint>(rect.size());
+    result.scores = COWMatrix<int>(rect.size());
+    result.reliabilities = COWMatrix<qreal>(rect.size());
+
+    for (int j=0; j<rect.height(); ++j)
+        for (int i=0; i<rect.width(); ++i) {
+            QPoint p = rect.topLeft() + QPoint(i, j);
+            result.offsets.set(i, j, offsetMap_.get(p));
+            result.scores.set(i, j, scoreMap_.get(p));
+            result.reliabilities.set(i, j, reliabilityMap_.get(p));
+        }
+
+    return result;
 }
 
-RandomSearchResult SimilarityMapper::randomSearchKernel(QPoint p) const
+void SimilarityMapper::setFieldRegion(const QPoint& topLeft, const NnField& region)
+{
+    for (int j=0; j<region.offsets.height(); ++j)
+        for (int i=0; i<region.offsets.width(); ++i) {
+            QPoint p = topLeft + QPoint(i, j);
+            qreal reliability = region.reliabilities.get(i, j);
+
+            offsetMap_.set(p, region.offsets.get(i, j));
+            scoreMap_.set(p, region.scores.get(i, j));
+            reliabilityMap_.set(p, reliability);
+            setWeight(p, reliability);
+            if (!knn_.isNull())
+                knn_.reset(p, region.offsets.get(i, j), region.scores.get(i, j));
+        }
+}
+
+void SimilarityMapper::chunkRange(int size, int chunk, int* begin, int* end) const
+{
+    // the last chunk takes the remainder
+    int range_len = size/chunkCount_;
+    *begin = chunk*range_len;
+    *end = (chunk == chunkCount_-1)?size:*begin+range_len;
+}
+
+void SimilarityMapper::performRandomSearchForChunk(const FillSpans* points,
+        QVector<RandomSearchResult>* results, int chunk) const
+{
+    int begin, end;
+    chunkRange(points->size(), chunk, &begin, &end);
+
+    QVector<RandomSearchResult>& chunk_results = results[chunk];
+    chunk_results.reserve(end-begin);
+
+    CandidateCounts counts;
+    for (FillSpans::Iterator it = points->range(begin, end); !it.atEnd(); ++it)
+        chunk_results.push_back(randomSearchKernel(*it, &counts));
+    addCandidateCounts(counts);
+}
+
+void SimilarityMapper::queryIndexForChunk(const FillSpans* points,
+        QVector<RandomSearchResult>* results, int chunk) const
+{
+    int begin, end;
+    chunkRange(points->size(), chunk, &begin, &end);
+
+    QVector<RandomSearchResult>& chunk_results = results[chunk];
+    chunk_results.reserve(end-begin);
+
+    float descriptor[PatchIndex::DESCRIPTOR_DIM];
+    QPoint candidates[INDEX_CANDIDATES];
+
+    for (FillSpans::Iterator it = points->range(begin, end); !it.atEnd(); ++it) {
+        QPoint p = *it;
+
+        RandomSearchResult result;
+        result.point = p;
+        result.offset = offsetMap_.get(p);
+        result.score = scoreMap_.get(p);
+
+        if (result.score != 0) {
+            index_.describe(paddedDst_, p + QPoint(R, R), descriptor);
+            int count = index_.query(descriptor, INDEX_CANDIDATES, INDEX_MAX_LEAVES, candidates);
+            for (int c=0; c<count; ++c)
+                updateSource(p, &result.offset, candidates[c] - p, &result.score);
+        }
+
+        chunk_results.push_back(result);
+    }
+}
+
+void SimilarityMapper::queryIndex()
+{
+    TRACE_ME
+
+    if (index_.isEmpty())
+        index_.build(src_, validSources_);
+
+    QVector<QVector<RandomSearchResult> > opinions(chunkCount_);
+    parallel_for_chunks(pool_, chunkCount_,
+            boost::bind(&SimilarityMapper::queryIndexForChunk, this,
+                &pointsToFill_, opinions.data(), _1));
+
+    applyResults(opinions);
+    report_max_score();
+}
+
+void SimilarityMapper::applyResults(const QVector<QVector<RandomSearchResult> >& results)
+{
+    foreach(const QVector<RandomSearchResult>& chunk_results, results)
+        foreach(RandomSearchResult rsr, chunk_results) {
+            offsetMap_.set(rsr.point, rsr.offset);
+            setScore(rsr.point, rsr.score);
+            if (!knn_.isNull())
+                knn_.insert(rsr.point, rsr.offset, rsr.score);
+        }
+}
+
+void SimilarityMapper::performKnnSearchForChunk(const FillSpans* points,
+        QVector<RandomSearchResult>* results, int chunk)
+{
+    int begin, end;
+    chunkRange(points->size(), chunk, &begin, &end);
+
+    QVector<RandomSearchResult>& chunk_results = results[chunk];
+    chunk_results.reserve(end-begin);
+
+    for (FillSpans::Iterator it = points->range(begin, end); !it.atEnd(); ++it)
+        chunk_results.push_back(knnSearchKernel(*it));
+}
+
+// writes only to the knn slots of p, so it can run in parallel
+RandomSearchResult SimilarityMapper::knnSearchKernel(QPoint p)
+{
+    RandomSearchResult result;
+    result.point = p;
+
+    int k = knn_.k();
+    QPoint* offsets = knn_.offsets(p);
+    int* scores = knn_.scores(p);
+
+    result.score = KnnField::best(offsets, scores, k, &result.offset);
+    if (result.score == 0)
+        return result;
+
+    // search around every candidate we had before this pass
+    QPoint centres[MAX_NEIGHBOUR_COUNT];
+    std::copy(offsets, offsets+k, centres);
+
+    // see randomSearchKernel
+    int block_range = searchRange(p);
+    for (int n=0; n<k; ++n)
+        for (int range=initSearchRange_; range>0; range=(range>block_range)?block_range:range/2) {
+            QPoint o(centres[n]);
+            o.rx() += qrand()%(2*range) - range;
+            o.ry() += qrand()%(2*range) - range;
+            o = clampOffset(o);
+
+            if (KnnField::contains(offsets, scores, k, o))
+                continue;
+
+            QPoint unused;
+            int score = scores[0];
+            if (updateSource(p, &unused, o, &score))
+                KnnField::insert(offsets, scores, k, o, score);
+        }
+
+    result.score = KnnField::best(offsets, scores, k, &result.offset);
+    return result;
+}
+
+void SimilarityMapper::propagateKnn(QPoint p, const QPolygon& neighbourOffsets)
+{
+    int k = knn_.k();
+
+    foreach (QPoint dp, neighbourOffsets) {
+        QPoint pdp = p+dp;
+        if (!dst_.rect().contains(pdp) || (SMModeMasked == mode_ && dstMask_.test(pdp)))
+            continue;
+
+        // try every candidate of our neighbour
+        const QPoint* neighbours_offsets = knn_.offsets(pdp);
+        const int* neighbours_scores = knn_.scores(pdp);
+        for (int n=0; n<k; ++n) {
+            int threshold = knn_.threshold(p);
+            if (neighbours_scores[n] == INT_MAX ||
+                neighbours_scores[n] - 4*R*SIGMA2 >= threshold ||
+                knn_.contains(p, neighbours_offsets[n]))
+                continue;
+
+            QPoint unused;
+            if (updateSource(p, &unused, neighbours_offsets[n], &threshold))
+                knn_.insert(p, neighbours_offsets[n], threshold);
+        }
+    }
+
+    QPoint best_offset;
+    int best_score = knn_.best(p, &best_offset);
+    setScore(p, best_score);
+    offsetMap_.set(p, best_offset);
+}
+
+RandomSearchResult SimilarityMapper::randomSearchKernel(QPoint p, CandidateCounts* counts) const
 {
     RandomSearchResult result;
 
@@ -122,11 +809,25 @@ RandomSearchResult SimilarityMapper::randomSearchKernel(QPoint p) const
         return result;
     }
 
-    for (int range=initSearchRange_; range>0; range/=2) {
+    // one candidate from anywhere keeps blocks with a small range from
+    // settling into a local minimum, then halving from the block's range;
+    // all around the offset the search started from, as in the PatchMatch
+    // paper, so the next candidate's patch is fetched while one is scored
+    QPoint candidates[MAX_SEARCH_CANDIDATES];
+    int count = 0;
+    int block_range = searchRange(p);
+    for (int range=initSearchRange_; range>0 && count<MAX_SEARCH_CANDIDATES;
+         range=(range>block_range)?block_range:range/2) {
         QPoint o(best_offset);
         o.rx() += qrand()%(2*range) - range;
         o.ry() += qrand()%(2*range) - range;
-        updateSource(p, &best_offset, o, &best_score);
+        candidates[count++] = clampOffset(o);
+    }
+
+    for (int n=0; n<count; ++n) {
+        if (n+1 < count)
+            prefetchSource(p + candidates[n+1]);
+        updateSource(p, &best_offset, candidates[n], &best_score, counts);
     }
 
     result.point = p;
@@ -137,87 +838,162 @@ RandomSearchResult SimilarityMapper::randomSearchKernel(QPoint p) const
 
 
 
-COWMatrix<QPoint> SimilarityMapper::iterate(const QImage& dst)
+COWMatrix<QPoint> SimilarityMapper::iterate(const ImageView& dst)
 {
     TRACE_ME
 
-    dst_ = dst;
-    initSearchRange_ = qMax(src_.width(), src_.height());
+    int pass_count = beginPasses(dst);
+    for (int pass=0; pass<pass_count; ++pass) {
+        runPass(pass);
+        if (deadline_ >= 0 && clock_.elapsed() >= deadline_)
+            break;
+    }
+    endPasses();
 
-    QVector<QPolygon> neighbour_offsets_passes(4);
-    neighbour_offsets_passes[0] << QPoint(0, -1) << QPoint(-1, 0);
-    neighbour_offsets_passes[1] << QPoint(0,  1) << QPoint(-1, 0);
-    neighbour_offsets_passes[2] << QPoint(0,  1) << QPoint( 1, 0);
-    neighbour_offsets_passes[3] << QPoint(0, -1) << QPoint( 1, 0);
-
-    for (int pass=0; pass<PASS_COUNT; ++pass) {
-        // refine pass
-        // there are two kinds of places where we can look for better matches:
-        // 1. Obviously, random places
-        // 2. Propagation: trying points near our neighbour's source
-
-        const QPolygon& neighbour_offsets = neighbour_offsets_passes[pass%4];
-        const QPolygon& points = (pass%2)?reversePointsToFill_:pointsToFill_;
-
-        QVector<QPolygon> ranges;
-        int range_len = points.size()/JOB_CHUNK_COUNT;
-        for (int i=0; i<JOB_CHUNK_COUNT; ++i) {
-            QPolygon tmp(range_len);
-            std::copy(points.begin() + (i*range_len), points.begin() + ((i+1)*range_len), tmp.begin());
-            ranges.push_back(tmp);
-        }
+    return offsetMap_;
+}
 
-        auto vector_joiner = (QVector<RandomSearchResult>& (QVector<RandomSearchResult>::*)(const QVector<RandomSearchResult>&))
-                    (&QVector<RandomSearchResult>::operator+=);
+int SimilarityMapper::beginPasses(const ImageView& dst)
+{
+    // votes between iterations change dst, the stored scores of patches
+    // over changed pixels would compare candidates against stale colours
+    BitMask changed = changed_pixels(dst_, dst);
+
+    // only the rows votes touched are copied, paddedDst_ isn't shared
+    // so writing to it doesn't detach
+    DetachCheck detach_check(paddedDst_);
+    for (int j=0; j<dst.height(); ++j)
+        if (changed.nextSet(j, 0) < dst.width())
+            update_padded_image(&paddedDst_, dst, R, j, j+1);
+    detach_check.check(paddedDst_);
 
-        QVector<RandomSearchResult> opinions = QtConcurrent::blockingMappedReduced(ranges,
-                boost::bind(&SimilarityMapper::performRandomSearchForRange, this, _1),
-                vector_joiner);
+    if (SMModeSimple == mode_)
+        dstSums_ = patch_sums(paddedDst_);
+    rescore(changed.dilated(R));
+    initSearchRange_ = qMax(src_.width(), src_.height());
+    // offsets stay within the window, so do candidates
+    if (maxDisplacement_ >= 0)
+        initSearchRange_ = qMin(initSearchRange_, qMax(1, 2*maxDisplacement_));
+
+    int pass_count = passCount_;
+    if (SMEngineDescriptorIndex == engine_) {
+        // seed with index matches, then let PatchMatch smooth things out
+        queryIndex();
+        pass_count = qMin(pass_count, INDEX_PASS_COUNT);
+    }
 
-        foreach(RandomSearchResult rsr, opinions) {
-            offsetMap_.set(rsr.point, rsr.offset);
-            scoreMap_.set(rsr.point, rsr.score);
-            reliabilityMap_.set(rsr.point, std::max(qExp(-rsr.score/SIGMA2), QREAL_MIN));
-        }
+    return pass_count;
+}
 
-        // propagate good guess
-        foreach(QPoint p, points) {
-            QPoint best_offset = offsetMap_.get(p);
-            int best_score = scoreMap_.get(p);
+void SimilarityMapper::runPass(int pass)
+{
+    // refine pass
+    // there are two kinds of places where we can look for better matches:
+    // 1. Obviously, random places
+    // 2. Propagation: trying points near our neighbour's source
+
+    QPolygon neighbour_offsets;
+    switch (pass%4) {
+    case 0: neighbour_offsets << QPoint(0, -1) << QPoint(-1, 0); break;
+    case 1: neighbour_offsets << QPoint(0,  1) << QPoint(-1, 0); break;
+    case 2: neighbour_offsets << QPoint(0,  1) << QPoint( 1, 0); break;
+    case 3: neighbour_offsets << QPoint(0, -1) << QPoint( 1, 0); break;
+    }
 
-            if (best_score == 0)
-                continue;
+    QVector<QVector<RandomSearchResult> > opinions(chunkCount_);
+    if (knn_.isNull()) {
+        parallel_for_chunks(pool_, chunkCount_,
+                boost::bind(&SimilarityMapper::performRandomSearchForChunk, this,
+                    &pointsToFill_, opinions.data(), _1));
+    } else {
+        knn_.detach();
+        parallel_for_chunks(pool_, chunkCount_,
+                boost::bind(&SimilarityMapper::performKnnSearchForChunk, this,
+                    &pointsToFill_, opinions.data(), _1));
+    }
 
-            foreach (QPoint dp, neighbour_offsets) {
-                QPoint pdp = p+dp;
-                if (pdp.x() >= 0 && pdp.y() >= 0 && (SMModeSimple == mode_ || (
-                    pdp.x() < dstMask_.width() && pdp.y() < dstMask_.height() &&
-                    !dstMask_.pixelIndex(pdp))))
-                {
-                    // our neighbour is unknown point too
-                    // maybe his offset is better than ours
-                    QPoint neighbours_offset = offsetMap_.get(p+dp);
-                    if (scoreMap_.get(p+dp) - 4*R*SIGMA2 < scoreMap_.get(p))
-                        updateSource(p, &best_offset, neighbours_offset, &best_score);
-                }
-            }
+    updateSearchRanges(opinions);
+    applyResults(opinions);
 
-            // save found offset
-            scoreMap_.set(p, best_score);
-            reliabilityMap_.set(p, std::max(qExp(-best_score/SIGMA2), QREAL_MIN));
-            offsetMap_.set(p, best_offset);
+    // propagate good guess, every pass walks the other way round
+    CandidateCounts counts;
+    for (FillSpans::Iterator it = pointsToFill_.begin(FillSpans::Order(pass%4)); !it.atEnd(); ++it) {
+        QPoint p = *it;
+
+        if (!knn_.isNull()) {
+            if (scoreMap_.get(p) != 0)
+                propagateKnn(p, neighbour_offsets);
+            continue;
         }
-        if (pass%2) {
-            std::reverse(pointsToFill_.begin(), pointsToFill_.end());
-            std::reverse(reversePointsToFill_.begin(), reversePointsToFill_.end());
+
+        QPoint best_offset = offsetMap_.get(p);
+        int best_score = scoreMap_.get(p);
+
+        if (best_score == 0)
+            continue;
+
+        foreach (QPoint dp, neighbour_offsets) {
+            QPoint pdp = p+dp;
+            if (dst_.rect().contains(pdp) && (SMModeSimple == mode_ || !dstMask_.test(pdp)))
+            {
+                // our neighbour is unknown point too
+                // maybe his offset is better than ours
+                QPoint neighbours_offset = offsetMap_.get(p+dp);
+                if (scoreMap_.get(p+dp) - 4*R*SIGMA2 < scoreMap_.get(p))
+                    updateSource(p, &best_offset, neighbours_offset, &best_score, &counts);
+            }
         }
 
-        emit iterationComplete(offsetMap_, reliabilityMap_);
+        // save found offset
+        setScore(p, best_score);
+        offsetMap_.set(p, best_offset);
     }
+    addCandidateCounts(counts);
+
+    emit iterationComplete(offsetMap_, reliabilityMap_);
+}
 
+void SimilarityMapper::endPasses()
+{
     report_max_score();
+}
 
-    return offsetMap_;
+int SimilarityMapper::searchRange(QPoint p) const
+{
+    return qMin(initSearchRange_, searchRanges_.get(p.x()/SEARCH_BLOCK, p.y()/SEARCH_BLOCK));
+}
+
+// before applyResults, offsetMap_ still has the offsets the search started from
+void SimilarityMapper::updateSearchRanges(const QVector<QVector<RandomSearchResult> >& results)
+{
+    COWMatrix<int> jumps(searchRanges_.size(), 0);
+    foreach(const QVector<RandomSearchResult>& chunk_results, results)
+        foreach(RandomSearchResult rsr, chunk_results) {
+            if (rsr.score == 0)
+                continue;
+            QPoint jump = rsr.offset - offsetMap_.get(rsr.point);
+            int length = qMax(qAbs(jump.x()), qAbs(jump.y()));
+            QPoint block(rsr.point.x()/SEARCH_BLOCK, rsr.point.y()/SEARCH_BLOCK);
+            if (length > jumps.get(block))
+                jumps.set(block, length);
+        }
+
+    for (int j=0; j<searchRanges_.height(); ++j)
+        for (int i=0; i<searchRanges_.width(); ++i) {
+            int range = qMin(initSearchRange_, searchRanges_.get(i, j));
+            range = qMax(2*jumps.get(i, j), range/2);
+            searchRanges_.set(i, j, qBound(qMin(MIN_SEARCH_RANGE, initSearchRange_), range, initSearchRange_));
+        }
+}
+
+QPoint SimilarityMapper::clampOffset(QPoint offset) const
+{
+    if (maxDisplacement_ < 0)
+        return offset;
+
+    QPoint c = displacementCentre_;
+    return QPoint(qBound(c.x() - maxDisplacement_, offset.x(), c.x() + maxDisplacement_),
+                  qBound(c.y() - maxDisplacement_, offset.y(), c.y() + maxDisplacement_));
 }
 
 void SimilarityMapper::report_max_score()
@@ -226,8 +1002,8 @@ void SimilarityMapper::report_max_score()
     int min_score = INT_MAX;
     meanScore_ = 0;
 
-    foreach(QPoint p, pointsToFill_) {
-        int score = scoreMap_.get(p);
+    for (FillSpans::Iterator it = pointsToFill_.begin(FillSpans::TopDownLeftRight); !it.atEnd(); ++it) {
+        int score = scoreMap_.get(*it);
         maxScore_ = qMax(maxScore_, score);
         min_score = qMin(min_score, score);
         meanScore_ += score;
@@ -238,49 +1014,94 @@ void SimilarityMapper::report_max_score()
     qDebug() << "score : max =" << maxScore_
         << "mean =" << meanScore_
         << "min =" << min_score;
+
+    if (SMModeSimple != mode_)
+        return;
+
+    int tested = candidatesTested_.fetchAndStoreRelaxed(0);
+    int rejected = candidatesRejected_.fetchAndStoreRelaxed(0);
+    if (tested)
+        qDebug() << "mean bound rejected" << rejected << "of" << tested
+            << "candidates," << 100.0*rejected/tested << "%";
 }
 
 bool SimilarityMapper::updateSource(QPoint p, QPoint* best_offset,
-    QPoint candidate_offset, int* best_score) const
+    QPoint candidate_offset, int* best_score, CandidateCounts* counts) const
 {
     if (SMModeSimple == mode_)
-        return updateSourceSimple(p, best_offset, candidate_offset, best_score);
+        return updateSourceSimple(p, best_offset, candidate_offset, best_score, counts);
     else
         return updateSourceMasked(p, best_offset, candidate_offset, best_score);
 }
 
-bool SimilarityMapper::updateSourceMasked(QPoint p, QPoint* best_offset,
-    QPoint candidate_offset, int* best_score) const
+bool SimilarityMapper::isValidSource(QPoint p, QPoint s) const
+{
+    if (maxDisplacement_ >= 0) {
+        QPoint d = s - p - displacementCentre_;
+        if (qAbs(d.x()) > maxDisplacement_ || qAbs(d.y()) > maxDisplacement_)
+            return false;
+    }
+
+    // we need only true real patches as sources,
+    // patches over the edges read the apron
+    return validSources_.contains(s) && validSources_.test(s);
+}
+
+// top left of the source patch around s, stride is the distance
+// between its rows in pixels
+inline const QRgb* SimilarityMapper::srcPatch(QPoint s, int* stride) const
 {
-    QRect bounds(QPoint(0, 0), src_.size());
+    if (!srcTiles_.isNull()) {
+        *stride = SourceTiles::TILE_SIDE;
+        return srcTiles_.patch(s + QPoint(R, R));
+    }
 
-    int dw = dst_.width();
-    int dh = dst_.height();
+    *stride = paddedSrc_.width();
+    return reinterpret_cast<const QRgb*>(paddedSrc_.bits()) + s.y()*paddedSrc_.width() + s.x();
+}
+
+void SimilarityMapper::prefetchSource(QPoint s) const
+{
+    if (!validSources_.contains(s) || !validSources_.test(s))
+        return;
+
+    int stride;
+    const QRgb* row = srcPatch(s, &stride);
+    // a patch row is 36 bytes, it can straddle two cache lines
+    for (int j=0; j<2*R+1; ++j, row += stride) {
+        __builtin_prefetch(row);
+        __builtin_prefetch(row + 2*R);
+    }
+}
 
-    int sw = src_.width();
-    int sh = src_.height();
+bool SimilarityMapper::updateSourceMasked(QPoint p, QPoint* best_offset,
+    QPoint candidate_offset, int* best_score) const
+{
+    int dw = paddedDst_.width();
 
     // source point
     QPoint s = p + candidate_offset;
 
-    // fuck the edge cases
-    if (p.x() < R || p.x() >= dw-R || p.y() < R || p.y() >= dh-R ||
-        s.x() < R || s.x() >= sw-R || s.y() < R || s.y() >= sh-R)
+    if (!isValidSource(p, s))
         return false;
 
-    // we need only true real patches as sources
-    if (!srcMask_.pixelIndex(s))
-        return false;
+    if (SMWeightsFixed == weights_) {
+        int score = maskedScoreFixed(p, s);
+        if (*best_score <= score)
+            return false;
 
-    if (!bounds.contains(p) || !bounds.contains(s))
-        return false;
+        *best_score = score;
+        *best_offset = candidate_offset;
+        return true;
+    }
 
     double score = 0;
     double weight_sum = 0;
 
-    const qreal* weight_ptr = reliabilityMap_.ptrAt(p-QPoint(R,R));
-    const QRgb* ns_pixel_ptr = reinterpret_cast<const QRgb*>(src_.bits()) + (s.y()-R)*sw + (s.x()-R);
-    const QRgb* np_pixel_ptr = reinterpret_cast<const QRgb*>(dst_.bits()) + (p.y()-R)*dw + (p.x()-R);
+    int sw;
+    const qreal* weight_ptr = weightMap_.ptrAt(p);
+    const QRgb* ns_pixel_ptr = srcPatch(s, &sw);
+    const QRgb* np_pixel_ptr = reinterpret_cast<const QRgb*>(paddedDst_.bits()) + p.y()*dw + p.x();
     for (int j=-R; j<=R; ++j) {
         for (int i=-R; i<=R; ++i) {
             const quint8* ns_rgb = reinterpret_cast<const quint8*>(ns_pixel_ptr);
@@ -309,27 +1130,94 @@ bool SimilarityMapper::updateSourceMasked(QPoint p, QPoint* best_offset,
     return true;
 }
 
-bool SimilarityMapper::updateSourceSimple(QPoint p, QPoint* best_offset,
-    QPoint candidate_offset, int* best_score) const
+// Weighted mean of per-pixel SSD like the double path, with weights
+// quantized to 1/65535 steps and integer accumulation.
+//
+// Accuracy against the double path: every weight is off by at most
+// 1/65535 (weights under that, i.e. scores above ~190, are raised to
+// 1/65535), so for a patch with total double weight W and largest
+// |ssd - score| deviation D the result differs by at most
+// 81*D/(65535*W) plus 1 from integer truncation. Any patch with a single
+// known pixel has W >= 1, which keeps it within 0.0013*D + 1. Only patches
+// made entirely of very unreliable pixels (W < 81/65535) drift towards
+// an unweighted mean.
+int SimilarityMapper::maskedScoreFixed(QPoint p, QPoint s) const
+{
+    int dw = paddedDst_.width();
+    int sw;
+
+    qint64 score = 0;
+    int weight_sum = 0;
+
+    const quint16* weight_ptr = fixedReliabilityMap_.ptrAt(p);
+    const quint8* ns_row = reinterpret_cast<const quint8*>(srcPatch(s, &sw));
+    const quint8* np_row = paddedDst_.bits() + 4*(p.y()*dw + p.x());
+    for (int j=-R; j<=R; ++j) {
+        // branch free integer loop over a patch row
+        for (int i=0; i<2*R+1; ++i) {
+            score += (qint64)ssd4(ns_row + 4*i, np_row + 4*i)*weight_ptr[i];
+            weight_sum += weight_ptr[i];
+        }
+        weight_ptr += dw;
+        ns_row += 4*sw;
+        np_row += 4*dw;
+    }
+
+    return score/weight_sum;
+}
+
+// Sum of squared differences of two patches of N pixels is at least
+// (S_a - S_b)^2/N per channel, where S are the channel sums (Cauchy-Schwarz
+// on the per-pixel differences), so candidates whose mean colour is too far
+// off are dropped without reading the patches. Integer division rounds the
+// bound down, which keeps it a bound.
+int SimilarityMapper::meanBound(QPoint p, QPoint s) const
+{
+    const quint16* a = srcSums_.get(s).channels;
+    const quint16* b = dstSums_.get(p).channels;
+
+    // at most 4*(N*255)^2, fits an int for R up to 4
+    int sum = 0;
+    for (int c=0; c<4; ++c) {
+        int d = (int)a[c] - (int)b[c];
+        sum += d*d;
+    }
+    return sum/((2*R+1)*(2*R+1));
+}
+
+void SimilarityMapper::addCandidateCounts(const CandidateCounts& counts) const
 {
-    int dw = dst_.width();
-    int dh = dst_.height();
+    // always the case in masked mode
+    if (!counts.tested)
+        return;
+    candidatesTested_.fetchAndAddRelaxed(counts.tested);
+    candidatesRejected_.fetchAndAddRelaxed(counts.rejected);
+}
 
-    int sw = src_.width();
-    int sh = src_.height();
+bool SimilarityMapper::updateSourceSimple(QPoint p, QPoint* best_offset,
+    QPoint candidate_offset, int* best_score, CandidateCounts* counts) const
+{
+    int dw = paddedDst_.width();
 
     // source point
     QPoint s = p + candidate_offset;
 
-    // fuck the edge cases
-    if (p.x() < R || p.x() >= dw-R || p.y() < R || p.y() >= dh-R ||
-        s.x() < R || s.x() >= sw-R || s.y() < R || s.y() >= sh-R)
+    if (!isValidSource(p, s))
+        return false;
+
+    bool rejected = meanBound(p, s) >= *best_score;
+    if (counts) {
+        ++counts->tested;
+        counts->rejected += rejected;
+    }
+    if (rejected)
         return false;
 
     int score = 0;
 
-    const QRgb* ns_pixel_ptr = reinterpret_cast<const QRgb*>(src_.bits()) + (s.y()-R)*sw + (s.x()-R);
-    const QRgb* np_pixel_ptr = reinterpret_cast<const QRgb*>(dst_.bits()) + (p.y()-R)*dw + (p.x()-R);
+    int sw;
+    const QRgb* ns_pixel_ptr = srcPatch(s, &sw);
+    const QRgb* np_pixel_ptr = reinterpret_cast<const QRgb*>(paddedDst_.bits()) + p.y()*dw + p.x();
     for (int j=-R; j<=R; ++j) {
         for (int i=-R; i<=R; ++i) {
             const quint8* ns_rgb = reinterpret_cast<const quint8*>(ns_pixel_ptr);
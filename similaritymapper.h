@@ -1,9 +1,20 @@
 #ifndef UNSEEIT_SIMILARITYMAPPER_H
 #define UNSEEIT_SIMILARITYMAPPER_H
 
+#include <QAtomicInt>
 #include <QImage>
 #include <QPolygon>
+#include <QTime>
+#include "bitmask.h"
 #include "cowmatrix.h"
+#include "fillspans.h"
+#include "imageview.h"
+#include "knnfield.h"
+#include "nnfcache.h"
+#include "patchindex.h"
+#include "sourcetiles.h"
+
+class QThreadPool;
 
 enum SimilarityMapperMode
 {
@@ -11,6 +22,38 @@ enum SimilarityMapperMode
     SMModeMasked
 };
 
+enum SimilarityMapperWeights
+{
+    // double reliabilities in the masked distance
+    SMWeightsDouble,
+    // 16 bit fixed point reliabilities and integer arithmetic,
+    // see maskedScoreFixed for the accuracy
+    SMWeightsFixed
+};
+
+enum SimilarityMapperEngine
+{
+    // random search and propagation only
+    SMEnginePatchMatch,
+    // kd-tree over PCA patch descriptors, refined by a few PatchMatch passes
+    SMEngineDescriptorIndex
+};
+
+enum SimilarityMapperLayout
+{
+    // patches are read straight from the source QImage
+    SMLayoutRowMajor,
+    // from a SourceTiles copy built by init, for large sources where
+    // patch reads miss the cache and TLB
+    SMLayoutTiled
+};
+
+// channel sums of a patch, for cheap lower bounds of patch distances
+struct PatchSum
+{
+    quint16 channels[4];
+};
+
 struct RandomSearchResult
 {
     QPoint point;
@@ -24,15 +67,85 @@ class SimilarityMapper: public QObject
     Q_OBJECT
 
 public:
-    // src, dst - argb32, src_mask - mono
-    void init(const QImage& src, const QImage& dst, const QImage& srcMask, const QImage& dstMask);
-    void init(const QImage& src, const QImage& dst);
-    COWMatrix<QPoint> iterate(const QImage& dst);
+    SimilarityMapper(QObject* parent = 0);
+
+    // random search passes are split into chunkCount jobs on pool
+    void setThreadPool(QThreadPool* pool, int chunkCount);
+
+    void setEngine(SimilarityMapperEngine engine) { engine_ = engine; }
+
+    // call before init
+    void setWeightMode(SimilarityMapperWeights weights) { weights_ = weights; }
+
+    // call before init
+    void setSourceLayout(SimilarityMapperLayout layout) { layout_ = layout; }
+
+    // keep k best distinct offsets per pixel instead of one,
+    // call before init
+    void setNeighbourCount(int k) { neighbourCount_ = k; }
+
+    // src, dst - argb32, srcMask - valid source centres,
+    // dstMask - known dst pixels; src and dst are copied, the views
+    // are only read during the call, here and in iterate
+    void init(const ImageView& src, const ImageView& dst, const BitMask& srcMask, const BitMask& dstMask);
+    void init(const ImageView& src, const ImageView& dst);
+    COWMatrix<QPoint> iterate(const ImageView& dst);
+
+    // iterate in steps, for callers that act between passes:
+    // beginPasses returns the number of passes to run, runPass must be
+    // called for 0 .. count-1 in order; patches over pixels of dst that
+    // changed since the last call are rescored first
+    int beginPasses(const ImageView& dst);
+    void runPass(int pass);
+    void endPasses();
+
+    // passes per iterate call
+    void setPassCount(int passCount) { passCount_ = passCount; }
+
+    // iterate stops after the pass that ends past msec of clock,
+    // it always runs at least one; negative msec means no deadline
+    void setDeadline(const QTime& clock, int msec) { clock_ = clock; deadline_ = msec; }
+
+    // only dst rows [begin, end) are mapped, the others only take
+    // offsets from seed and setFieldRegion. Call before init
+    void setMappedRows(int begin, int end) { mappedBegin_ = begin; mappedEnd_ = end; }
+
+    // only offsets within d pixels of centre (in both directions) are
+    // searched; centre is non-zero for dst tiles cut out of a larger
+    // image, negative d means no limit. Call before init
+    void setMaxDisplacement(int d, QPoint centre = QPoint()) {
+        maxDisplacement_ = d;
+        displacementCentre_ = centre;
+    }
+
+    // after init: start from the given offsets instead of random ones,
+    // they are scored against the dst given to init, offsets which
+    // don't point to a valid source stay random
+    void seed(const COWMatrix<QPoint>& offsets);
+
+    // after init: take a stored field as is, scores included,
+    // only valid for the very same inputs
+    void restore(const NnField& field);
+
+    NnField field() const;
+
+    // part of the field, and overwriting a part of it with values
+    // computed elsewhere (e.g. borders of neighbouring shards)
+    NnField fieldRegion(const QRect& rect) const;
+    void setFieldRegion(const QPoint& topLeft, const NnField& region);
 
     const COWMatrix<int>* scoreMap() const { return &scoreMap_; };
-    const COWMatrix<double> reliabilityMap() const { return reliabilityMap_; };
+    const COWMatrix<qreal> reliabilityMap() const { return reliabilityMap_; };
     const QVector<qreal> confidenceMap() const;
 
+    // null unless neighbour count is above one
+    const KnnField& knnField() const { return knn_; }
+
+    // exp(-score/SIGMA2), from a table, never below QREAL_MIN
+    static qreal scoreToReliability(int score);
+    // the same in 1/65535 units, never below 1
+    static quint16 scoreToFixedReliability(int score);
+
     double meanScore() const { return meanScore_; }
     int maxScore() const { return maxScore_; }
 
@@ -40,39 +153,130 @@ signals:
     void iterationComplete(COWMatrix<QPoint>, COWMatrix<qreal>);
 
 private:
+    // mean bound statistics of one chunk or pass, kept locally and added
+    // to the totals once, so threads don't share a counter per candidate
+    struct CandidateCounts
+    {
+        CandidateCounts(): tested(0), rejected(0) {}
+        int tested;
+        int rejected;
+    };
+
+    // counts - where the mean bound counts go, NULL to not count
     bool updateSource(QPoint p, QPoint* current_offset,
-        QPoint candidate_offset, int* score) const;
+        QPoint candidate_offset, int* score, CandidateCounts* counts = NULL) const;
     bool updateSourceSimple(QPoint p, QPoint* current_offset,
-        QPoint candidate_offset, int* score) const;
+        QPoint candidate_offset, int* score, CandidateCounts* counts) const;
     bool updateSourceMasked(QPoint p, QPoint* current_offset,
         QPoint candidate_offset, int* score) const;
+    bool isValidSource(QPoint p, QPoint s) const;
+    const QRgb* srcPatch(QPoint s, int* stride) const;
+    void prefetchSource(QPoint s) const;
+    QPoint clampOffset(QPoint offset) const;
+    int searchRange(QPoint p) const;
+    void updateSearchRanges(const QVector<QVector<RandomSearchResult> >& results);
+    int meanBound(QPoint p, QPoint s) const;
+    void addCandidateCounts(const CandidateCounts& counts) const;
+    int maskedScoreFixed(QPoint p, QPoint s) const;
+    void setScore(QPoint p, int score);
+    void setWeight(QPoint p, qreal reliability);
+    void updateWeightMaps();
+    static quint16 quantizeReliability(qreal reliability);
     void report_max_score();
 
-    QVector<RandomSearchResult> performRandomSearchForRange(QPolygon points) const;
-    RandomSearchResult randomSearchKernel(QPoint p) const;
+    void chunkRange(int size, int chunk, int* begin, int* end) const;
+    void performRandomSearchForChunk(const FillSpans* points,
+        QVector<RandomSearchResult>* results, int chunk) const;
+    void queryIndexForChunk(const FillSpans* points,
+        QVector<RandomSearchResult>* results, int chunk) const;
+    void queryIndex();
+    void seedForChunk(const QPolygon* points, const COWMatrix<QPoint>* offsets,
+        QVector<RandomSearchResult>* results, int chunk) const;
+    void boxSeedForChunk(const QVector<QPolygon>* groups, const COWMatrix<QPoint>* offsets,
+        QVector<RandomSearchResult>* results, int chunk) const;
+    void boxScoreGroup(QPoint offset, const QPolygon& points,
+        QVector<RandomSearchResult>* results) const;
+    void initKnn();
+    void rescore(const BitMask& dirty);
+    void rescoreForChunk(const QPolygon* points,
+        QVector<RandomSearchResult>* results, int chunk);
+    void performKnnSearchForChunk(const FillSpans* points,
+        QVector<RandomSearchResult>* results, int chunk);
+    RandomSearchResult knnSearchKernel(QPoint p);
+    void propagateKnn(QPoint p, const QPolygon& neighbourOffsets);
+    void applyResults(const QVector<QVector<RandomSearchResult> >& results);
+    RandomSearchResult randomSearchKernel(QPoint p, CandidateCounts* counts) const;
 
     COWMatrix<int> scoreMap_;
 
     // reliability = exp(-score/SIGMA2);
     COWMatrix<qreal> reliabilityMap_;
+    // what the distance kernels read as weights, copies of reliabilityMap_
+    // padded like paddedDst_ with zero weights: weightMap_ is only kept
+    // with SMWeightsDouble, the quantized fixedReliabilityMap_ with
+    // SMWeightsFixed
+    COWMatrix<qreal> weightMap_;
+    COWMatrix<quint16> fixedReliabilityMap_;
 
     COWMatrix<QPoint> offsetMap_;
 
-    QPolygon reversePointsToFill_;
-    QPolygon pointsToFill_;
+    // k best offsets, offsetMap_ and scoreMap_ keep the best of them
+    KnnField knn_;
+    int neighbourCount_;
+
+    FillSpans pointsToFill_;
 
-    // read-only
-    QImage dst_;
-    QImage src_;
-    QImage srcMask_;
-    QImage dstMask_;
+    // both with an R pixel apron repeating the edges (see padded_image),
+    // so the patch around any pixel can be read without bounds checks;
+    // the patch around p starts at p in them. Owned by the mapper alone,
+    // paddedDst_ is updated in place as dst changes
+    QImage paddedDst_;
+    QImage paddedSrc_;
+    // the unpadded pixels, views into the two above
+    ImageView dst_;
+    ImageView src_;
+    // of paddedSrc_, null with SMLayoutRowMajor
+    SourceTiles srcTiles_;
+    // srcMask, every pixel in simple mode
+    BitMask validSources_;
+    // masked mode only
+    BitMask dstMask_;
+
+    // simple mode only: the masked distance is a mean weighted by the
+    // reliabilities of the dst patch, which are all but zero over the hole,
+    // so per-pixel summaries give it no useful lower bound and it neither
+    // keeps the sums nor counts candidates
+    COWMatrix<PatchSum> srcSums_;
+    COWMatrix<PatchSum> dstSums_;
+
+    // since the last report, simple mode only
+    mutable QAtomicInt candidatesTested_;
+    mutable QAtomicInt candidatesRejected_;
 
     double meanScore_;
     int maxScore_;
 
     SimilarityMapperMode mode_;
+    SimilarityMapperWeights weights_;
+    SimilarityMapperEngine engine_;
+    SimilarityMapperLayout layout_;
+
+    PatchIndex index_;
 
     int initSearchRange_;
+    // per SEARCH_BLOCK square of dst, where random search starts halving;
+    // follows the longest improvements found there in recent passes
+    COWMatrix<int> searchRanges_;
+    int mappedBegin_;
+    int mappedEnd_;
+    int maxDisplacement_;
+    QPoint displacementCentre_;
+    int passCount_;
+    QTime clock_;
+    int deadline_;
+
+    QThreadPool* pool_;
+    int chunkCount_;
 };
 
 #endif
@@ -0,0 +1,139 @@
+#include "sourcelibrary.h"
+
+#include <QFile>
+#include <QPainter>
+#include <QStringList>
+#include <algorithm>
+
+#include "utils.h"
+
+SourceLibrary::SourceLibrary(int r): r_(r)
+{
+}
+
+void SourceLibrary::addSource(const QImage& image, const QImage& excludeMask)
+{
+    Source source;
+    source.image = image.convertToFormat(QImage::Format_ARGB32);
+    source.excludeMask = excludeMask;
+    sources_ << source;
+}
+
+bool SourceLibrary::addList(const QString& listFilename)
+{
+    QFile list(listFilename);
+    if (!list.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qDebug() << "can't open" << listFilename;
+        return false;
+    }
+
+    while (!list.atEnd()) {
+        QStringList fields = QString(list.readLine()).trimmed().split(" ", QString::SkipEmptyParts);
+        if (fields.isEmpty())
+            continue;
+
+        QImage image(fields[0]);
+        if (image.isNull()) {
+            qDebug() << "can't load" << fields[0];
+            return false;
+        }
+        addSource(image, (fields.size() > 1)?QImage(fields[1]):QImage());
+    }
+
+    return true;
+}
+
+void SourceLibrary::prepare(int levelCount)
+{
+    TRACE_ME
+
+    levels_.clear();
+
+    for (int lod_level=0; lod_level<levelCount; ++lod_level) {
+        Level level;
+
+        QVector<QImage> images;
+        int atlas_width = 0;
+        int atlas_height = 0;
+        foreach(const Source& source, sources_) {
+            QSize lodSize = lod_size(source.image.size(), lod_level);
+            images << source.image.scaled(lodSize,
+                    Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+            level.top << atlas_height;
+            level.sizes << lodSize;
+            atlas_width = qMax(atlas_width, lodSize.width());
+            atlas_height += lodSize.height();
+        }
+
+        level.atlas = QImage(atlas_width, atlas_height, QImage::Format_ARGB32);
+        level.atlas.fill(0);
+        level.mask = BitMask(atlas_width, atlas_height);
+
+        QPainter painter(&level.atlas);
+        for (int s=0; s<images.size(); ++s) {
+            const QImage& image = images[s];
+            painter.drawImage(QPoint(0, level.top[s]), image);
+
+            // count excluded pixels in every window with an integral image,
+            // a centre is valid when its whole patch is usable
+            int w = image.width();
+            int h = image.height();
+            QVector<int> integral((w+1)*(h+1), 0);
+
+            QImage exclude;
+            if (!sources_[s].excludeMask.isNull())
+                exclude = sources_[s].excludeMask.scaled(image.size(),
+                        Qt::IgnoreAspectRatio, Qt::FastTransformation);
+
+            for (int j=0; j<h; ++j)
+                for (int i=0; i<w; ++i) {
+                    int excluded = (!exclude.isNull() && qGray(exclude.pixel(i, j)) > 127)?1:0;
+                    integral[(j+1)*(w+1) + i+1] = excluded
+                        + integral[j*(w+1) + i+1]
+                        + integral[(j+1)*(w+1) + i]
+                        - integral[j*(w+1) + i];
+                }
+
+            for (int j=r_; j<h-r_; ++j)
+                for (int i=r_; i<w-r_; ++i) {
+                    int x1 = i-r_, x2 = i+r_+1;
+                    int y1 = j-r_, y2 = j+r_+1;
+                    int excluded = integral[y2*(w+1) + x2] - integral[y1*(w+1) + x2]
+                                 - integral[y2*(w+1) + x1] + integral[y1*(w+1) + x1];
+                    if (!excluded)
+                        level.mask.set(i, level.top[s] + j);
+                }
+        }
+        painter.end();
+
+        qDebug() << "library level" << lod_level << level.atlas.size();
+        levels_ << level;
+    }
+}
+
+int SourceLibrary::locate(int level, QPoint atlasPoint, QPoint* local) const
+{
+    const Level& l = levels_[level];
+    if (atlasPoint.y() < 0 || atlasPoint.x() < 0 || atlasPoint.x() >= l.atlas.width())
+        return -1;
+
+    // sources are stacked top to bottom
+    int index = std::upper_bound(l.top.begin(), l.top.end(), atlasPoint.y()) - l.top.begin() - 1;
+    if (index < 0 || !QRect(QPoint(0, l.top[index]), l.sizes[index]).contains(atlasPoint))
+        return -1;
+
+    if (local)
+        *local = atlasPoint - QPoint(0, l.top[index]);
+    return index;
+}
+
+COWMatrix<int> SourceLibrary::sourceIndices(int level, const COWMatrix<QPoint>& offsets) const
+{
+    COWMatrix<int> result(offsets.size(), -1);
+
+    for (int j=0; j<offsets.height(); ++j)
+        for (int i=0; i<offsets.width(); ++i)
+            result.set(i, j, locate(level, QPoint(i, j) + offsets.get(i, j)));
+
+    return result;
+}
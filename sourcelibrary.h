@@ -0,0 +1,72 @@
+#ifndef UNSEEIT_SOURCELIBRARY_H
+#define UNSEEIT_SOURCELIBRARY_H
+
+#include <QImage>
+#include <QPoint>
+#include <QString>
+#include <QVector>
+
+#include "bitmask.h"
+#include "cowmatrix.h"
+
+// A set of source images shared by many inpainting jobs.
+//
+// For every pyramid level all sources are stacked into one atlas image
+// with a mask of valid patch centres, so the mapper searches the whole
+// library as if it was a single source. Offsets point into the atlas,
+// locate() turns atlas positions back into (source index, position).
+//
+// Once prepared the library is read-only and can be used from any thread.
+class SourceLibrary
+{
+public:
+    SourceLibrary(int r);
+
+    // excludeMask - light pixels must not be used, null uses the whole image
+    void addSource(const QImage& image, const QImage& excludeMask = QImage());
+
+    // adds every source of a list file, one "image [exclude_mask]" per line;
+    // false if the list or any image can't be read
+    bool addList(const QString& listFilename);
+
+    // builds atlases for levels 0 .. levelCount-1,
+    // level l has lod_size like the levels of Resynthesizer::inpaintHier
+    void prepare(int levelCount);
+
+    int sourceCount() const { return sources_.size(); }
+    int levelCount() const { return levels_.size(); }
+
+    // argb32
+    const QImage& atlas(int level) const { return levels_[level].atlas; }
+    // set for valid patch centres
+    const BitMask& atlasMask(int level) const { return levels_[level].mask; }
+
+    // index of the source containing atlasPoint, or -1;
+    // local gets the position inside that source
+    int locate(int level, QPoint atlasPoint, QPoint* local = 0) const;
+
+    // source index for every pixel of an offset field over dst
+    COWMatrix<int> sourceIndices(int level, const COWMatrix<QPoint>& offsets) const;
+
+private:
+    struct Source
+    {
+        QImage image;
+        QImage excludeMask;
+    };
+
+    struct Level
+    {
+        QImage atlas;
+        BitMask mask;
+        // first atlas row of every source
+        QVector<int> top;
+        QVector<QSize> sizes;
+    };
+
+    int r_;
+    QVector<Source> sources_;
+    QVector<Level> levels_;
+};
+
+#endif
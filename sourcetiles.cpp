@@ -0,0 +1,48 @@
+#include "sourcetiles.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+SourceTiles::SourceTiles(const QImage& image, int r):
+    r_(r), core_(TILE_SIDE - 2*r), columns_(0), first_(0)
+{
+    TRACE_ME
+
+    Q_ASSERT(core_ > 0);
+    Q_ASSERT(image.depth() == 32);
+
+    int width = image.width();
+    int height = image.height();
+    if (width <= 2*r || height <= 2*r)
+        return;
+
+    columns_ = (width - 2*r + core_-1)/core_;
+    int rows = (height - 2*r + core_-1)/core_;
+    // tiles divide pages of 4 KB and more, so with the first on a page
+    // boundary none crosses one; a page more is room to get there
+    const int tile_size = TILE_SIDE*TILE_SIDE;
+    const int page = qMax(int(sysconf(_SC_PAGESIZE)), int(tile_size*sizeof(QRgb)));
+    storage_ = QVector<QRgb>(columns_*rows*tile_size + page/sizeof(QRgb), 0);
+    QRgb* tile = storage_.data();
+    int misalignment = reinterpret_cast<uintptr_t>(tile) % page;
+    if (misalignment)
+        first_ = (page - misalignment)/sizeof(QRgb);
+    tile += first_;
+
+    // the last row and column of tiles are cut by the image edges,
+    // what is outside stays 0 and is never part of a valid patch
+    for (int ty=0; ty<rows; ++ty)
+        for (int tx=0; tx<columns_; ++tx, tile += TILE_SIDE*TILE_SIDE) {
+            int x0 = tx*core_;
+            int y0 = ty*core_;
+            int copy_width = qMin(int(TILE_SIDE), width - x0);
+            int copy_height = qMin(int(TILE_SIDE), height - y0);
+            for (int j=0; j<copy_height; ++j)
+                memcpy(tile + j*TILE_SIDE,
+                       reinterpret_cast<const QRgb*>(image.scanLine(y0+j)) + x0,
+                       4*copy_width);
+        }
+}
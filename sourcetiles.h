@@ -0,0 +1,48 @@
+#ifndef UNSEEIT_SOURCETILES_H
+#define UNSEEIT_SOURCETILES_H
+
+#include <QImage>
+#include <QPoint>
+#include <QVector>
+
+// Source image cut into TILE_SIDE x TILE_SIDE pixel tiles of 4 KB each,
+// aligned so that no tile crosses a page boundary.
+//
+// Tiles overlap by 2r pixels: every tile holds a square of patch centres
+// plus the r pixels around it, so the whole patch of any centre is inside
+// one tile. A patch read then stays within one page and its rows are
+// TILE_SIDE pixels apart, instead of a full image row apart. Costs about
+// (TILE_SIDE/(TILE_SIDE-2r))^2 times the memory of the image.
+class SourceTiles
+{
+public:
+    enum { TILE_SIDE = 32 };
+
+    SourceTiles(): r_(0), core_(0), columns_(0), first_(0) {}
+
+    // image - argb32, r - patch radius, below TILE_SIDE/2
+    SourceTiles(const QImage& image, int r);
+
+    bool isNull() const { return storage_.isEmpty(); }
+
+    // top left pixel of the patch around s, rows are TILE_SIDE apart;
+    // s has to be at least r pixels away from the image edges
+    const QRgb* patch(const QPoint& s) const {
+        int tx = (s.x()-r_)/core_;
+        int ty = (s.y()-r_)/core_;
+        return storage_.constData() + first_ + (ty*columns_ + tx)*TILE_SIDE*TILE_SIDE
+            + (s.y()-r_ - ty*core_)*TILE_SIDE + (s.x()-r_ - tx*core_);
+    }
+
+private:
+    int r_;
+    // centres per tile side
+    int core_;
+    int columns_;
+    // tiles start at storage_[first_], the first page boundary in it;
+    // copies share the data, so the alignment holds for them too
+    QVector<QRgb> storage_;
+    int first_;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include "tiledimageitem.h"
+
+#include <QAtomicInt>
+#include <QPainter>
+#include <QPixmap>
+#include <QPixmapCache>
+#include <QStyleOptionGraphicsItem>
+#include <qmath.h>
+
+#include "utils.h"
+
+namespace {
+
+const int TILE_SIZE = 256;
+
+QAtomicInt next_id(0);
+
+};
+
+TiledImageItem::TiledImageItem(QGraphicsItem* parent): QGraphicsItem(parent),
+    id_(next_id.fetchAndAddRelaxed(1))
+{
+    // paint gets the exposed rect, so only visible tiles are drawn
+    setFlag(ItemUsesExtendedStyleOption);
+}
+
+void TiledImageItem::setImage(const QImage& image)
+{
+    prepareGeometryChange();
+
+    // tiles of the old image can't be hit anymore
+    id_ = next_id.fetchAndAddRelaxed(1);
+
+    levels_.clear();
+    if (image.isNull()) {
+        update();
+        return;
+    }
+
+    levels_ << image;
+    while (levels_.last().width() > TILE_SIZE || levels_.last().height() > TILE_SIZE) {
+        const QImage& previous = levels_.last();
+        levels_ << previous.scaled(lod_size(previous.size(), 1),
+                Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    }
+
+    update();
+}
+
+QRectF TiledImageItem::boundingRect() const
+{
+    return QRectF(0, 0, image().width(), image().height());
+}
+
+int TiledImageItem::levelFor(qreal levelOfDetail) const
+{
+    if (levelOfDetail >= 1)
+        return 0;
+    int level = int(floor(log(1/levelOfDetail)/log(2.0)));
+    return qBound(0, level, levels_.size()-1);
+}
+
+void TiledImageItem::paint(QPainter* painter, const QStyleOptionGraphicsItem* option, QWidget*)
+{
+    if (levels_.isEmpty())
+        return;
+
+    int level = levelFor(QStyleOptionGraphicsItem::levelOfDetailFromTransform(painter->worldTransform()));
+    const QImage& image = levels_[level];
+
+    // level pixels per item pixel
+    qreal sx = qreal(image.width())/levels_[0].width();
+    qreal sy = qreal(image.height())/levels_[0].height();
+
+    QRectF exposed = option->exposedRect & boundingRect();
+    int first_column = qMax(0, int(exposed.left()*sx)/TILE_SIZE);
+    int last_column = qMin((image.width()-1)/TILE_SIZE, int(exposed.right()*sx)/TILE_SIZE);
+    int first_row = qMax(0, int(exposed.top()*sy)/TILE_SIZE);
+    int last_row = qMin((image.height()-1)/TILE_SIZE, int(exposed.bottom()*sy)/TILE_SIZE);
+
+    for (int j=first_row; j<=last_row; ++j)
+        for (int i=first_column; i<=last_column; ++i) {
+            QRect tile = QRect(i*TILE_SIZE, j*TILE_SIZE, TILE_SIZE, TILE_SIZE) & image.rect();
+
+            QString key = QString("unseeit-tile-%1-%2-%3-%4").arg(id_).arg(level).arg(i).arg(j);
+            QPixmap pixmap;
+            if (!QPixmapCache::find(key, &pixmap)) {
+                pixmap = QPixmap::fromImage(image.copy(tile));
+                QPixmapCache::insert(key, pixmap);
+            }
+
+            QRectF target(tile.x()/sx, tile.y()/sy, tile.width()/sx, tile.height()/sy);
+            painter->drawPixmap(target, pixmap, QRectF(pixmap.rect()));
+        }
+}
@@ -0,0 +1,37 @@
+#ifndef UNSEEIT_TILEDIMAGEITEM_H
+#define UNSEEIT_TILEDIMAGEITEM_H
+
+#include <QGraphicsItem>
+#include <QImage>
+#include <QVector>
+
+// Image item for pictures too large for one pixmap.
+//
+// Keeps a mipmap pyramid of the image in memory and draws it as square
+// tiles of the level matching the current zoom. Tiles are converted to
+// pixmaps only when they are exposed and are kept in QPixmapCache, so
+// pixmap memory follows the viewport instead of the image size.
+class TiledImageItem: public QGraphicsItem
+{
+public:
+    TiledImageItem(QGraphicsItem* parent = 0);
+
+    void setImage(const QImage& image);
+    const QImage& image() const { return levels_.isEmpty()?empty_:levels_[0]; }
+
+    QRectF boundingRect() const;
+    void paint(QPainter* painter, const QStyleOptionGraphicsItem* option, QWidget* widget = 0);
+
+private:
+    // the coarsest level still at least as detailed as the screen
+    int levelFor(qreal levelOfDetail) const;
+
+    // level 0 is the image, every next one has lod_size
+    QVector<QImage> levels_;
+    QImage empty_;
+
+    // tells cached tiles of different items and images apart
+    int id_;
+};
+
+#endif
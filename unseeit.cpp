@@ -0,0 +1,79 @@
+#include "unseeit.h"
+
+#include <QImage>
+#include <QThreadPool>
+#include <string.h>
+
+#include "consts.h"
+#include "utils.h"
+
+namespace {
+
+// the image shares the caller's pixels and is read-only,
+// anything writing to it detaches first
+QImage wrap_image(const UnseeitImage& image)
+{
+    return QImage(const_cast<const uchar*>(image.data),
+        image.width, image.height, image.stride, QImage::Format_ARGB32);
+}
+
+// rows must hold width pixels of 4 and 1 bytes
+bool is_valid(const UnseeitImage& image)
+{
+    return image.data && image.width > 0 && image.height > 0 && image.stride >= 4*(qint64)image.width;
+}
+
+bool is_valid(const UnseeitMask& mask)
+{
+    return mask.data && mask.width > 0 && mask.height > 0 && mask.stride >= mask.width;
+}
+
+};
+
+UnseeitOptions::UnseeitOptions():
+    preset(RPresetBalanced), timeBudget(0),
+    pool(NULL), chunkCount(JOB_CHUNK_COUNT),
+    library(NULL), fieldCache(NULL),
+    sourceRegion(NULL), maxDisplacement(-1)
+{
+}
+
+bool unseeit_inpaint(const UnseeitImage& input, const UnseeitMask& mask,
+    const UnseeitImage& output, const UnseeitOptions& options)
+{
+    if (!is_valid(input) || !is_valid(mask) || !is_valid(output) ||
+        (options.sourceRegion && !is_valid(*options.sourceRegion))) {
+        qDebug() << "unseeit_inpaint: bad buffer";
+        return false;
+    }
+
+    if (input.width != mask.width || input.height != mask.height ||
+        input.width != output.width || input.height != output.height ||
+        (options.sourceRegion && (options.sourceRegion->width != input.width ||
+                                  options.sourceRegion->height != input.height))) {
+        qDebug() << "unseeit_inpaint: sizes don't match";
+        return false;
+    }
+
+    Resynthesizer r;
+    r.setThreadPool(options.pool?options.pool:QThreadPool::globalInstance(), options.chunkCount);
+    r.setPreset(options.preset);
+    r.setTimeBudget(options.timeBudget);
+    r.setSourceLibrary(options.library);
+    r.setFieldCache(options.fieldCache);
+    r.setProgressCallback(options.progress);
+    r.setMaxDisplacement(options.maxDisplacement);
+
+    const UnseeitMask* region = options.sourceRegion;
+    if (region)
+        r.setSourceRegion(BitMask::fromBytes(region->data, region->width, region->height, region->stride));
+
+    // the engine works on bits, the mask is read once to pack them
+    BitMask holes = BitMask::fromBytes(mask.data, mask.width, mask.height, mask.stride);
+    const QImage result = r.inpaintHier(wrap_image(input), holes);
+
+    for (int j=0; j<output.height; ++j)
+        memcpy(output.data + j*output.stride, result.scanLine(j), 4*output.width);
+
+    return true;
+}
@@ -0,0 +1,71 @@
+#ifndef UNSEEIT_UNSEEIT_H
+#define UNSEEIT_UNSEEIT_H
+
+#include <QtGlobal>
+
+#include "resynthesizer.h"
+
+class NnfCache;
+class QThreadPool;
+class SourceLibrary;
+
+// Engine entry point over caller-owned buffers.
+//
+// Pixels are read in place without a copy, the mask is read once to pack
+// it into bits; the filled image is written straight into the caller's
+// output buffer. Callers with QImages can use Resynthesizer directly.
+
+// 32 bit pixels, 0xAARRGGBB in native byte order
+// (QImage::Format_ARGB32 and Format_RGB32 layout)
+struct UnseeitImage
+{
+    uchar* data;
+    int width;
+    int height;
+    // bytes from the start of one row to the next
+    int stride;
+};
+
+// one byte per pixel, non-zero pixels are holes
+struct UnseeitMask
+{
+    const uchar* data;
+    int width;
+    int height;
+    int stride;
+};
+
+struct UnseeitOptions
+{
+    UnseeitOptions();
+
+    ResynthesizerPreset preset;
+    // milliseconds, 0 means no limit, see Resynthesizer::setTimeBudget
+    int timeBudget;
+
+    // PatchMatch passes are split into chunkCount jobs on pool,
+    // null pool uses the global one
+    QThreadPool* pool;
+    int chunkCount;
+
+    // optional, must outlive the call
+    const SourceLibrary* library;
+    const NnfCache* fieldCache;
+
+    // optional, see Resynthesizer::setProgressCallback
+    ResynthesizerProgress progress;
+
+    // optional spatial priors, see Resynthesizer::setSourceRegion:
+    // non-zero pixels of sourceRegion may be copied from, and only from
+    // at most maxDisplacement pixels away, negative for no limit
+    const UnseeitMask* sourceRegion;
+    int maxDisplacement;
+};
+
+// fills the holes of input and writes the whole image to output,
+// output may be input; false if a buffer is null, a stride is shorter
+// than a row or the sizes don't match
+bool unseeit_inpaint(const UnseeitImage& input, const UnseeitMask& mask,
+    const UnseeitImage& output, const UnseeitOptions& options = UnseeitOptions());
+
+#endif
@@ -7,8 +7,15 @@ TARGET =
 DEPENDPATH += .
 INCLUDEPATH += .
 
+# the engine comes from engine.pro, build that first
+LIBS += -L. -lunseeitengine
+PRE_TARGETDEPS += libunseeitengine.a
+
 # Input
-HEADERS += window.h resynthesizer.h utils.h randomoffsetgenerator.h similaritymapper.h patchmatchwindow.h cowmatrix.h
-SOURCES += main.cpp window.cpp resynthesizer.cpp randomoffsetgenerator.cpp similaritymapper.cpp utils.cpp patchmatchwindow.cpp
+HEADERS += window.h patchmatchwindow.h benchmark.h inpaintdaemon.h tiledimageitem.h
+SOURCES += main.cpp window.cpp patchmatchwindow.cpp benchmark.cpp inpaintdaemon.cpp tiledimageitem.cpp
+
+# the daemon listens on a local socket
+QT += network
 
 QMAKE_CXXFLAGS += -O2 -g -std=c++0x -Wshadow
@@ -1,11 +1,23 @@
 #include "utils.h"
 
 #include <math.h>
+#include <string.h>
 
 #include <QColor>
 #include <qmath.h>
 #include <QtGlobal>
 
+QImage mask_to_overlay(const QImage& mask)
+{
+    QImage result(mask.size(), QImage::Format_ARGB32);
+
+    for (int j=0; j<mask.height(); ++j)
+        for (int i=0; i<mask.width(); ++i)
+            result.setPixel(i, j, (qGray(mask.pixel(i, j)) > 127)?0xff000000:0);
+
+    return result;
+}
+
 QImage downscale_mask(const QImage mask, const QSize dstSize)
 {
     TRACE_ME
@@ -34,24 +46,146 @@ QImage downscale_mask(const QImage mask, const QSize dstSize)
     return result;
 }
 
+QImage padded_image(const ImageView& image, int r)
+{
+    QImage result(image.width() + 2*r, image.height() + 2*r, QImage::Format_ARGB32);
+    if (!image.isNull())
+        update_padded_image(&result, image, r, 0, image.height());
+
+    return result;
+}
+
+void update_padded_image(QImage* padded, const ImageView& image, int r, int begin, int end)
+{
+    int width = image.width();
+    int height = image.height();
+    Q_ASSERT(padded->size() == QSize(width + 2*r, height + 2*r));
+
+    // the first and last rows are repeated into the apron too
+    int padded_begin = (0 == begin)?0:begin+r;
+    int padded_end = (height == end)?height+2*r:end+r;
+    for (int j=padded_begin; j<padded_end; ++j) {
+        const QRgb* in = image.scanLine(qBound(0, j-r, height-1));
+        QRgb* out = reinterpret_cast<QRgb*>(padded->scanLine(j));
+        for (int i=0; i<r; ++i) {
+            out[i] = in[0];
+            out[r+width+i] = in[width-1];
+        }
+        memcpy(out + r, in, 4*width);
+    }
+}
+
+QSize lod_size(QSize size, int level)
+{
+    int d = (1 << level) - 1;
+    return QSize(qMax(1, (size.width() + d) >> level),
+                 qMax(1, (size.height() + d) >> level));
+}
+
+QVector<QRect> connected_components(const BitMask& mask, COWMatrix<int>* labels)
+{
+    QVector<QRect> result;
+    *labels = COWMatrix<int>(mask.size(), -1);
+
+    QVector<QPoint> stack;
+    for (int j=0; j<mask.height(); ++j)
+        for (int i=mask.nextSet(j, 0); i<mask.width(); i=mask.nextSet(j, i+1)) {
+            if (labels->get(i, j) >= 0)
+                continue;
+
+            // flood fill from here
+            int label = result.size();
+            QRect bounds(i, j, 1, 1);
+            labels->set(i, j, label);
+            stack.push_back(QPoint(i, j));
+            while (!stack.isEmpty()) {
+                QPoint p = stack.back();
+                stack.pop_back();
+                bounds |= QRect(p, QSize(1, 1));
+
+                for (int dy=-1; dy<=1; ++dy)
+                    for (int dx=-1; dx<=1; ++dx) {
+                        QPoint q = p + QPoint(dx, dy);
+                        if (mask.contains(q) && mask.test(q) && labels->get(q) < 0) {
+                            labels->set(q, label);
+                            stack.push_back(q);
+                        }
+                    }
+            }
+            result << bounds;
+        }
+
+    return result;
+}
+
+int inscribed_radius(const BitMask& mask)
+{
+    int w = mask.width();
+    int h = mask.height();
+    // nothing to measure against
+    const int far = w + h;
+
+    // two pass chessboard distance transform
+    COWMatrix<int> distance(w, h);
+    for (int j=0; j<h; ++j)
+        for (int i=0; i<w; ++i) {
+            int d = 0;
+            if (mask.test(i, j)) {
+                d = far;
+                if (i > 0)
+                    d = qMin(d, distance.get(i-1, j) + 1);
+                if (j > 0) {
+                    d = qMin(d, distance.get(i, j-1) + 1);
+                    if (i > 0)
+                        d = qMin(d, distance.get(i-1, j-1) + 1);
+                    if (i+1 < w)
+                        d = qMin(d, distance.get(i+1, j-1) + 1);
+                }
+            }
+            distance.set(i, j, d);
+        }
+
+    int result = 0;
+    for (int j=h-1; j>=0; --j)
+        for (int i=w-1; i>=0; --i) {
+            int d = distance.get(i, j);
+            if (!d)
+                continue;
+            if (i+1 < w)
+                d = qMin(d, distance.get(i+1, j) + 1);
+            if (j+1 < h) {
+                d = qMin(d, distance.get(i, j+1) + 1);
+                if (i+1 < w)
+                    d = qMin(d, distance.get(i+1, j+1) + 1);
+                if (i > 0)
+                    d = qMin(d, distance.get(i-1, j+1) + 1);
+            }
+            distance.set(i, j, d);
+            result = qMax(result, d);
+        }
+
+    return qMin(result, qMax(w, h));
+}
+
 COWMatrix<QPoint> resize_offset_map(const COWMatrix<QPoint> src, const QSize dstSize)
 {
     TRACE_ME
 
     COWMatrix<QPoint> result(dstSize);
 
-    qreal scale = static_cast<qreal>(dstSize.width())/src.width();
-    qreal inv_scale = 1.f/scale;
+    qreal scale_x = static_cast<qreal>(dstSize.width())/src.width();
+    qreal scale_y = static_cast<qreal>(dstSize.height())/src.height();
     int sw = src.width();
     int sh = src.height();
 
     for (int j=0; j<result.height(); ++j)
         for (int i=0; i<result.width(); ++i) {
-            int source_x = qBound(0, qRound(i*inv_scale), sw-1);
-            int source_y = qBound(0, qRound(j*inv_scale), sh-1);
+            // pixel centres line up
+            int source_x = qBound(0, int((i + 0.5)/scale_x), sw-1);
+            int source_y = qBound(0, int((j + 0.5)/scale_y), sh-1);
 
-            QPoint scaled_offset = src.get(source_x, source_y)*scale;
-            result.set(i, j, scaled_offset);
+            QPoint offset = src.get(source_x, source_y);
+            result.set(i, j, QPoint(qRound(offset.x()*scale_x), qRound(offset.y()*scale_y)));
         }
 
     return result;
@@ -6,8 +6,12 @@
 #include <QPoint>
 #include <QImage>
 #include <QTime>
+#include <QRect>
+#include <QVector>
 
+#include "bitmask.h"
 #include "cowmatrix.h"
+#include "imageview.h"
 
 struct ScopeTracer
 {
@@ -41,10 +45,37 @@ inline QRgb point_to_rgb(QPoint point) {
     return result;
 }
 
+// converts a mask image (light pixels are holes) to the overlay format
+// taken by Resynthesizer::inpaintHier (non-zero pixels are holes)
+QImage mask_to_overlay(const QImage& mask);
+
+// argb32 copy with an apron of r pixels on every side repeating the
+// edge pixels, pixel (i, j) of image is (i+r, j+r) of the result
+QImage padded_image(const ImageView& image, int r);
+
+// rewrites the rows of padded, a padded_image(image, r) of an earlier
+// version of image, that come from rows [begin, end) of image
+void update_padded_image(QImage* padded, const ImageView& image, int r, int begin, int end);
+
 // upscale and downscale routines
 
+// size of pyramid level l, every side is divided by 2^l rounding up,
+// so odd sizes keep their last row and column
+QSize lod_size(QSize size, int level);
+
+// 8-connected components of the set pixels, labels gets the index of the
+// component of every set pixel and -1 elsewhere; returns the bounding
+// rectangles of the components by index
+QVector<QRect> connected_components(const BitMask& mask, COWMatrix<int>* labels);
+
+// largest number of 8-connected steps from a set pixel to the nearest
+// clear one, pixels outside the mask don't count as clear
+int inscribed_radius(const BitMask& mask);
+
 QImage downscale_mask(const QImage mask, const QSize dstSize);
 
+// sides are scaled independently, so levels of non-power-of-two
+// sizes line up
 COWMatrix<QPoint> resize_offset_map(const COWMatrix<QPoint> src, const QSize dstSize);
 
 QImage visualizeOffsetMap(const COWMatrix<QPoint>& offsetMap);
@@ -9,14 +9,17 @@
 #include <qmath.h>
 
 #include "resynthesizer.h"
+#include "tiledimageitem.h"
 #include "utils.h"
 
 const int MAX_PAINT_SIZE = 20;
 const int MIN_PAINT_SIZE = 1;
+const int OVERLAY_TILE_SIZE = 256;
 
 Window::Window(QWidget* parent):QGraphicsView(parent),
+    overlayColumns_(0),
     pictureImage_(NULL), overlayImage_(NULL),
-    paintSize_(3)
+    paintSize_(3), fieldCache_(NULL), shardCount_(1)
 {
     setGeometry(0, 0, 1024, 768);
     setAlignment(0);
@@ -26,11 +29,11 @@ Window::Window(QWidget* parent):QGraphicsView(parent),
     setMouseTracking(true);
 
     rootItem_      = new QGraphicsRectItem;
-    imageItem_     = new QGraphicsPixmapItem(rootItem_);
+    imageItem_     = new TiledImageItem(rootItem_);
     overlayItem_   = new QGraphicsPixmapItem{imageItem_};
-    resultItem_    = new QGraphicsPixmapItem(rootItem_);
-    offsetMapItem_ = new QGraphicsPixmapItem(rootItem_);
-    scoreMapItem_  = new QGraphicsPixmapItem(rootItem_);
+    resultItem_    = new TiledImageItem(rootItem_);
+    offsetMapItem_ = new TiledImageItem(rootItem_);
+    scoreMapItem_  = new TiledImageItem(rootItem_);
 
     brushItem_ = new QGraphicsPixmapItem(overlayItem_);
 
@@ -42,6 +45,8 @@ Window::Window(QWidget* parent):QGraphicsView(parent),
     brushItem_->setAcceptHoverEvents(true);
 
     brushItem_->setOpacity(0.5);
+    // above the overlay tiles
+    brushItem_->setZValue(1);
 
     scene_->addItem(rootItem_);
 }
@@ -64,11 +69,12 @@ void Window::loadImage(const QString& filename)
         qDebug() << "loading image failed";
     }
     qDebug() << "format:" << pictureImage_->format();
-    imageItem_->setPixmap(QPixmap::fromImage(*pictureImage_));
+    imageItem_->setImage(*pictureImage_);
 
     delete overlayImage_;
     overlayImage_ = new QImage(pictureImage_->size(), QImage::Format_ARGB32);
     overlayImage_->fill(0);
+    createOverlayTiles();
 
     QRect frame = pictureImage_->rect();
     imageItem_->setPos(0, 0);
@@ -81,6 +87,66 @@ void Window::loadImage(const QString& filename)
     updateBrush();
 }
 
+void Window::createOverlayTiles()
+{
+    qDeleteAll(overlayTiles_);
+    overlayTiles_.clear();
+
+    overlayColumns_ = (overlayImage_->width() + OVERLAY_TILE_SIZE-1)/OVERLAY_TILE_SIZE;
+    int rows = (overlayImage_->height() + OVERLAY_TILE_SIZE-1)/OVERLAY_TILE_SIZE;
+
+    for (int j=0; j<rows; ++j)
+        for (int i=0; i<overlayColumns_; ++i) {
+            QRect tile = QRect(i*OVERLAY_TILE_SIZE, j*OVERLAY_TILE_SIZE,
+                    OVERLAY_TILE_SIZE, OVERLAY_TILE_SIZE) & overlayImage_->rect();
+            QGraphicsPixmapItem* item = new QGraphicsPixmapItem(overlayItem_);
+            item->setPos(tile.topLeft());
+            item->setPixmap(QPixmap::fromImage(overlayImage_->copy(tile)));
+            overlayTiles_ << item;
+        }
+}
+
+void Window::updateOverlay(const QRect& dirty)
+{
+    QRect rect = dirty & overlayImage_->rect();
+    if (rect.isEmpty())
+        return;
+
+    int first_column = rect.left()/OVERLAY_TILE_SIZE;
+    int last_column = rect.right()/OVERLAY_TILE_SIZE;
+    int first_row = rect.top()/OVERLAY_TILE_SIZE;
+    int last_row = rect.bottom()/OVERLAY_TILE_SIZE;
+
+    for (int j=first_row; j<=last_row; ++j)
+        for (int i=first_column; i<=last_column; ++i) {
+            QGraphicsPixmapItem* item = overlayTiles_[j*overlayColumns_ + i];
+            QPoint origin(i*OVERLAY_TILE_SIZE, j*OVERLAY_TILE_SIZE);
+            QRect part = rect & QRect(origin, QSize(OVERLAY_TILE_SIZE, OVERLAY_TILE_SIZE));
+
+            // only the part under the brush is converted
+            QPixmap pixmap = item->pixmap();
+            QPainter painter(&pixmap);
+            painter.setCompositionMode(QPainter::CompositionMode_Source);
+            painter.drawImage(part.translated(-origin), *overlayImage_, part);
+            painter.end();
+            item->setPixmap(pixmap);
+        }
+}
+
+void Window::paintOverlay(QPoint p, QRgb color)
+{
+    QRect brush = QRect(p - QPoint(paintSize_, paintSize_),
+            QSize(2*paintSize_+1, 2*paintSize_+1)) & overlayImage_->rect();
+
+    for (int j=brush.top(); j<=brush.bottom(); ++j) {
+        QRgb* line = reinterpret_cast<QRgb*>(overlayImage_->scanLine(j));
+        for (int i=brush.left(); i<=brush.right(); ++i)
+            line[i] = color;
+    }
+
+    updateOverlay(brush);
+}
+
 void Window::mousePressEvent(QMouseEvent* evt)
 {
     if (evt->buttons() & Qt::MiddleButton) {
@@ -99,15 +165,9 @@ void Window::mouseMoveEvent(QMouseEvent* evt)
     QPoint draw_location = (mapToScene(evt->pos()) - rootItem_->pos()).toPoint();
 
     if (evt->buttons() & Qt::LeftButton) {
-        for (int j=-paintSize_; j<=paintSize_; ++j)
-            for (int i=-paintSize_; i<=paintSize_; ++i)
-                overlayImage_->setPixel(draw_location+QPoint(i,j), 0xff000000);
-        overlayItem_->setPixmap(QPixmap::fromImage(*overlayImage_));
+        paintOverlay(draw_location, 0xff000000);
     } else if (evt->buttons() & Qt::RightButton) {
-        for (int j=-paintSize_; j<=paintSize_; ++j)
-            for (int i=-paintSize_; i<=paintSize_; ++i)
-                overlayImage_->setPixel(draw_location+QPoint(i,j), 0x00000000);
-        overlayItem_->setPixmap(QPixmap::fromImage(*overlayImage_));
+        paintOverlay(draw_location, 0x00000000);
     } else if (evt->buttons() & Qt::MiddleButton) {
         auto pan_to = mapToScene(evt->pos());
         QPointF dp = pan_to - prevPan_;
@@ -124,17 +184,19 @@ void Window::keyReleaseEvent(QKeyEvent* evt)
     switch (evt->key()) {
         case Qt::Key_Return: {
             Resynthesizer r;
+            r.setFieldCache(fieldCache_);
+            r.setShardCount(shardCount_);
 
             QImage result = r.inpaintHier(*pictureImage_, *overlayImage_);
-            resultItem_->setPixmap(QPixmap::fromImage(result));
+            resultItem_->setImage(result);
 
-            offsetMapItem_->setPixmap(QPixmap::fromImage(visualizeOffsetMap(r.offsetMap())));
-            scoreMapItem_->setPixmap(QPixmap::fromImage(visualizeReliabilityMap(r.reliabilityMap())));
+            offsetMapItem_->setImage(visualizeOffsetMap(r.offsetMap()));
+            scoreMapItem_->setImage(visualizeReliabilityMap(r.reliabilityMap()));
             break;
         }
         case Qt::Key_Space:
             overlayImage_->fill(0);
-            overlayItem_->setPixmap(QPixmap::fromImage(*overlayImage_));
+            updateOverlay(overlayImage_->rect());
             break;
         case Qt::Key_Plus:
             if (paintSize_ < MAX_PAINT_SIZE)
@@ -7,6 +7,10 @@
 #include <QGraphicsPixmapItem>
 #include <QGraphicsView>
 #include <QGraphicsScene>
+#include <QVector>
+
+class NnfCache;
+class TiledImageItem;
 
 class Window: public QGraphicsView
 {
@@ -18,6 +22,11 @@ public:
 
     void loadImage(const QString& filename);
 
+    void setFieldCache(const NnfCache* cache) { fieldCache_ = cache; }
+
+    // worker processes for PatchMatch on large images
+    void setShardCount(int count) { shardCount_ = count; }
+
 protected:
     virtual void mousePressEvent(QMouseEvent*);
     virtual void mouseReleaseEvent(QMouseEvent*);
@@ -30,11 +39,16 @@ private:
 
     QGraphicsRectItem* rootItem_;
 
-    QGraphicsPixmapItem* imageItem_;
+    TiledImageItem* imageItem_;
+    // parent of the overlay tiles and the brush
     QGraphicsPixmapItem* overlayItem_;
-    QGraphicsPixmapItem* resultItem_;
-    QGraphicsPixmapItem* offsetMapItem_;
-    QGraphicsPixmapItem* scoreMapItem_;
+    // OVERLAY_TILE_SIZE squares of overlayImage_ row by row, so painting
+    // only converts the tiles under the brush
+    QVector<QGraphicsPixmapItem*> overlayTiles_;
+    int overlayColumns_;
+    TiledImageItem* resultItem_;
+    TiledImageItem* offsetMapItem_;
+    TiledImageItem* scoreMapItem_;
 
     QGraphicsPixmapItem* brushItem_;
 
@@ -45,7 +59,16 @@ private:
 
     int paintSize_;
 
+    const NnfCache* fieldCache_;
+    int shardCount_;
+
     void updateBrush();
+
+    void createOverlayTiles();
+    // copies the dirty part of overlayImage_ to the tiles it touches
+    void updateOverlay(const QRect& dirty);
+    // fills the brush square around p, clipped to the overlay
+    void paintOverlay(QPoint p, QRgb color);
 };
 
 #endif